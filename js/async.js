@@ -0,0 +1,17 @@
+function start(resolve) {
+  setTimeout(resolve, 10, 40);
+}
+
+function addOne(x) {
+  return x + 1;
+}
+
+function later(x) {
+  return Promise.resolve(x + 1);
+}
+
+function main() {
+  return new Promise(start).then(addOne).then(later);
+}
+
+main().then(console.log);
@@ -0,0 +1,8 @@
+function main() {
+  console.log("hello", 'world');
+  console.log(1, 0.5, 0.1 + 0.2, 1 - 3, 123456789012345680000, 1e21, 0.000001, 0.0000001);
+  console.log(true, undefined);
+  return 42;
+}
+
+console.log(main());
@@ -0,0 +1,40 @@
+function* naturals() {
+  let n = 0;
+  while (true) {
+    yield n;
+    n = n + 1;
+  }
+}
+
+function* take(source, count) {
+  for (let i = 0; i < count; i = i + 1) {
+    let step = source.next();
+    if (step.done === true) {
+      return;
+    }
+    yield step.value;
+  }
+}
+
+function* running() {
+  let total = 0;
+  while (true) {
+    let value = yield total;
+    total = total + value;
+  }
+}
+
+function main() {
+  let numbers = take(naturals(), 10);
+  let sum = running();
+  sum.next();
+  let total = 0;
+  let step = numbers.next();
+  while (step.done === false) {
+    total = sum.next(step.value).value;
+    step = numbers.next();
+  }
+  return total;
+}
+
+console.log(main());
@@ -0,0 +1,20 @@
+function unused(a, b) {
+  function helper(c) {
+    return a + b + c;
+  }
+  return helper;
+}
+
+function double(x) {
+  return x + x;
+}
+
+function main() {
+  let total = 0;
+  for (let i = 0; i < 10; i = i + 1) {
+    total = total + double(i);
+  }
+  return total;
+}
+
+console.log(main());
@@ -0,0 +1,18 @@
+function main() {
+  let total = 0, odd = 0, n = 0;
+
+  for (let i = 0; i < 100000; i = i + 1) {
+    if (odd === 1) {
+      total = total + i;
+    }
+    odd = 1 - odd;
+  }
+
+  while (n < 10) {
+    n = n + 1;
+  }
+
+  return total + n;
+}
+
+console.log(main());
@@ -1,14 +1,41 @@
 #include "main.h"
 
-const bool kDebug = false;
+// Tracing. NOTJS_TRACE_LEVEL picks what is compiled in: 0 nothing, 1 the
+// binary events (recorded only while Trace is enabled) and the Profiler, 2
+// also the text log. Arguments of TRACE_EVENT and TRACE_LOG are evaluated
+// only when recorded.
+#ifndef NOTJS_TRACE_LEVEL
+#define NOTJS_TRACE_LEVEL 1
+#endif
+
+#if NOTJS_TRACE_LEVEL >= 1
+#define TRACE_EVENT(kind, name, value) \
+  do { if (Trace::enabled()) { Trace::record(kind, name, value); } } while (0)
+#else
+#define TRACE_EVENT(kind, name, value) do {} while (0)
+#endif
+
+#if NOTJS_TRACE_LEVEL >= 1
+#define TRACE_CALL(name, arguments) Trace::Call trace_call(name, arguments)
+#else
+#define TRACE_CALL(name, arguments) do {} while (0)
+#endif
+
+#if NOTJS_TRACE_LEVEL >= 1
+#define PROFILE_CALL(name) Profiler::Call profile_call(name)
+#else
+#define PROFILE_CALL(name) do {} while (0)
+#endif
+
+#if NOTJS_TRACE_LEVEL >= 2
+#define TRACE_LOG(...) log(__VA_ARGS__)
+#else
+#define TRACE_LOG(...) do {} while (0)
+#endif
 
 template <typename First, typename... Rest>
 void log(First first, Rest... rest)
 {
-  if (!kDebug) {
-    return;
-  }
-  
   std::string sep = " ";
   std::string end = "\n";
   
@@ -17,921 +44,7152 @@ void log(First first, Rest... rest)
   std::cout << end;
 }
 
-class JSNumber : public JSValue {
+enum class TraceKind : uint8_t {
+  CallEnter,
+  CallExit,
+  Lookup,
+  Allocation,
+};
+
+// Fixed size, so recording is a single store into the ring. Names are ids
+// from Trace::intern.
+struct TraceEvent {
+  uint64_t time;
+  uint64_t value;
+  uint32_t name;
+  uint32_t thread;
+  TraceKind kind;
+  uint8_t padding[7];
+};
+static_assert(sizeof(TraceEvent) == 32, "TraceEvent is written as is");
+
+// Where Lookup events found the variable
+enum class TraceLookup : uint64_t {
+  Frame,
+  Chain,
+  Global,
+};
+
+class Trace {
 public:
-  const double value;
+  // Per thread, older events are overwritten
+  static constexpr std::size_t kCapacity = 1 << 14;
+  
+  static bool enabled() { return enabled_.load(std::memory_order_relaxed); }
+  static void enable() { enabled_.store(true, std::memory_order_relaxed); }
+  static void disable() { enabled_.store(false, std::memory_order_relaxed); }
   
-  std::string serialize() const override { return std::to_string(value); };
+  static uint32_t intern(const std::string &name) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto found = names_.find(name);
+    if (found != names_.end()) {
+      return found->second;
+    }
+    auto id = static_cast<uint32_t>(strings_.size());
+    strings_.push_back(name);
+    names_.insert({name, id});
+    return id;
+  }
   
-  JSNumber(double value) : value(value){};
+  // Names of the allocation events, interned on first use so that recording
+  // them doesn't take the mutex
+  static uint32_t scope_name() {
+    static const uint32_t id = intern("Scope");
+    return id;
+  }
+  static uint32_t function_name() {
+    static const uint32_t id = intern("JSFunction");
+    return id;
+  }
+  static uint32_t generator_name() {
+    static const uint32_t id = intern("JSGenerator");
+    return id;
+  }
   
-  std::shared_ptr<JSValue>
-  plus_operator(std::shared_ptr<JSValue> right) const override {
-    return std::make_shared<JSNumber>(value + right->as_number()->value);
-  };
+  // Name of an id from intern
+  static std::string name(uint32_t id) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return id < strings_.size() ? strings_[id] : "#" + std::to_string(id);
+  }
   
-  std::shared_ptr<JSValue>
-  minus_operator(std::shared_ptr<JSValue> right) const override {
-    return std::make_shared<JSNumber>(value - right->as_number()->value);
-  };
+  static void record(TraceKind kind, uint32_t name, uint64_t value) {
+    auto &buffer = thread_buffer();
+    auto time = std::chrono::duration_cast<std::chrono::nanoseconds>(
+      std::chrono::steady_clock::now().time_since_epoch()).count();
+    auto &event = buffer.events[buffer.next++ & (kCapacity - 1)];
+    event.time = time;
+    event.value = value;
+    event.name = name;
+    event.thread = buffer.thread;
+    event.kind = kind;
+  }
   
-  std::shared_ptr<JSBoolean>
-  equalsequalsequals_operator(std::shared_ptr<JSValue> right) const override {
-    bool res = fabs(value - right->as_number()->value) < 0.0001f;
-    return std::make_shared<JSBoolean>(res);
+  // CallEnter and the matching CallExit, also when the call throws, see
+  // TRACE_CALL
+  class Call {
+  public:
+    Call(const Identifier &name, uint64_t arguments) : name_(enabled() ? name.trace_name() : kNone) {
+      if (name_ != kNone) {
+        record(TraceKind::CallEnter, name_, arguments);
+      }
+    }
+    Call(const Call &) = delete;
+    ~Call() {
+      if (name_ != kNone) {
+        record(TraceKind::CallExit, name_, 0);
+      }
+    }
+    
+  private:
+    static constexpr uint32_t kNone = UINT32_MAX;
+    uint32_t name_;
   };
   
-  std::shared_ptr<JSNumber> as_number() const override {
-    return std::make_shared<JSNumber>(*this);
+  static void clear() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (auto &buffer : buffers_) {
+      buffer->next = 0;
+    }
   }
   
-  std::shared_ptr<JSBoolean> as_boolean() const override {
-    return std::make_shared<JSBoolean>(true);
+  // Writes the names and the buffered events of all threads. Threads should
+  // not be recording at the same time.
+  static void dump(std::ostream &output) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    
+    write(output, kMagic);
+    write(output, static_cast<uint32_t>(strings_.size()));
+    for (const auto &string : strings_) {
+      write(output, static_cast<uint32_t>(string.size()));
+      output.write(string.data(), string.size());
+    }
+    
+    uint64_t count = 0;
+    for (const auto &buffer : buffers_) {
+      count += std::min<uint64_t>(buffer->next, kCapacity);
+    }
+    write(output, count);
+    for (const auto &buffer : buffers_) {
+      auto first = buffer->next > kCapacity ? buffer->next - kCapacity : 0;
+      for (auto i = first; i != buffer->next; ++i) {
+        write(output, buffer->events[i & (kCapacity - 1)]);
+      }
+    }
   }
   
-  std::shared_ptr<JSValue> call(Chain &chain, std::vector<std::shared_ptr<JSValue>> values) const override {
-    throw std::runtime_error(this->serialize() + " is not a function");
+  // Offline decoder for dump: one line per event, ordered by time, calls
+  // indented by depth.
+  static void decode(std::istream &input, std::ostream &output) {
+    if (read<uint32_t>(input) != kMagic) {
+      throw std::runtime_error("Trace::decode, not a trace");
+    }
+    
+    std::vector<std::string> strings(read<uint32_t>(input));
+    for (auto &string : strings) {
+      string.resize(read<uint32_t>(input));
+      input.read(string.data(), string.size());
+    }
+    
+    std::vector<TraceEvent> events(read<uint64_t>(input));
+    for (auto &event : events) {
+      event = read<TraceEvent>(input);
+    }
+    std::stable_sort(events.begin(), events.end(), [](const TraceEvent &a, const TraceEvent &b) {
+      return a.time < b.time;
+    });
+    
+    auto name = [&](uint32_t id) {
+      return id < strings.size() ? strings[id] : "#" + std::to_string(id);
+    };
+    std::map<uint32_t, std::size_t> depth;
+    auto start = events.empty() ? 0 : events.front().time;
+    
+    for (const auto &event : events) {
+      auto &thread_depth = depth[event.thread];
+      if (event.kind == TraceKind::CallExit && thread_depth > 0) {
+        --thread_depth;
+      }
+      
+      output << (event.time - start) << " [" << event.thread << "] " << std::string(thread_depth * 2, ' ');
+      switch (event.kind) {
+        case TraceKind::CallEnter:
+          output << "call " << name(event.name) << " (" << event.value << " argument(s))";
+          ++thread_depth;
+          break;
+        case TraceKind::CallExit:
+          output << "return " << name(event.name);
+          break;
+        case TraceKind::Lookup:
+          output << "lookup " << name(event.name);
+          switch (static_cast<TraceLookup>(event.value)) {
+            case TraceLookup::Frame: output << " (frame)"; break;
+            case TraceLookup::Chain: output << " (chain)"; break;
+            case TraceLookup::Global: output << " (global)"; break;
+          }
+          break;
+        case TraceKind::Allocation:
+          output << "allocate " << name(event.name) << " (" << event.value << " bytes)";
+          break;
+      }
+      output << "\n";
+    }
   }
-};
-
-class JSBoolean : public JSValue {
-public:
-  const bool value;
-  
-  std::string serialize() const override { return value ? "true" : "false"; };
-  
-  JSBoolean(const bool value) : value(value){};
   
-  std::shared_ptr<JSValue>
-  plus_operator(std::shared_ptr<JSValue> right) const override {
-    return std::make_shared<JSNumber>(value + right->as_number()->value);
-  };
+private:
+  static constexpr uint32_t kMagic = 0x524a4e4e; // "NNJR"
   
-  std::shared_ptr<JSValue>
-  minus_operator(std::shared_ptr<JSValue> right) const override {
-    return std::make_shared<JSNumber>(value - right->as_number()->value);
+  struct Buffer {
+    std::vector<TraceEvent> events = std::vector<TraceEvent>(kCapacity);
+    uint64_t next = 0;
+    uint32_t thread = 0;
   };
   
-  std::shared_ptr<JSBoolean>
-  equalsequalsequals_operator(std::shared_ptr<JSValue> right) const override {
-    return std::make_shared<JSBoolean>(false);
-  };
+  static inline std::atomic<bool> enabled_ {false};
+  static inline std::mutex mutex_;
+  static inline std::map<std::string, uint32_t> names_;
+  static inline std::vector<std::string> strings_;
+  // Kept after their threads exit, so dump still sees their events
+  static inline std::vector<std::shared_ptr<Buffer>> buffers_;
   
-  std::shared_ptr<JSNumber> as_number() const override {
-    return std::make_shared<JSNumber>(0);
+  static Buffer &thread_buffer() {
+    thread_local std::shared_ptr<Buffer> buffer = [] {
+      auto buffer = std::make_shared<Buffer>();
+      std::lock_guard<std::mutex> lock(mutex_);
+      buffer->thread = static_cast<uint32_t>(buffers_.size());
+      buffers_.push_back(buffer);
+      return buffer;
+    }();
+    return *buffer;
   }
   
-  std::shared_ptr<JSBoolean> as_boolean() const override {
-    return std::make_shared<JSBoolean>(*this);
+  template <typename T>
+  static void write(std::ostream &output, const T &value) {
+    output.write(reinterpret_cast<const char *>(&value), sizeof(T));
   }
   
-  std::shared_ptr<JSValue> call(Chain &chain, std::vector<std::shared_ptr<JSValue> > values) const override {
-    throw std::runtime_error(this->serialize() + " is not a function");
+  template <typename T>
+  static T read(std::istream &input) {
+    T value {};
+    if (!input.read(reinterpret_cast<char *>(&value), sizeof(T))) {
+      throw std::runtime_error("Trace::decode, truncated trace");
+    }
+    return value;
   }
 };
 
-class JSString : public JSValue {
+uint32_t Identifier::trace_name() const {
+  auto name = trace_name_.load(std::memory_order_relaxed);
+  if (name == kNoTraceName) {
+    name = Trace::intern(text);
+    trace_name_.store(name, std::memory_order_relaxed);
+  }
+  return name;
+}
+
+// Profiler
+//
+// Attributes hardware counters to JS functions. While the profiler is
+// enabled, every call and generator resume is pushed onto a per-thread
+// shadow stack. What the counters advanced while a function was on top of
+// the stack is charged to it (self cost, callees are charged to
+// themselves). The counters come from perf_event_open, so they are only
+// there on Linux and when the kernel allows it (see perf_event_paranoid);
+// otherwise only calls and time are collected. Reading them is a system
+// call per call and return, so profile for where the cycles and misses go,
+// not for wall time.
+enum class ProfileCounter {
+  Time,
+  Cycles,
+  Instructions,
+  CacheMisses,
+  BranchMisses,
+};
+
+const std::size_t kProfileCounters = 5;
+
+class Profiler {
 public:
-  const std::string value;
-  
-  std::string serialize() const override { return value; };
+  using Counters = std::array<uint64_t, kProfileCounters>;
   
-  std::shared_ptr<JSValue>
-  plus_operator(std::shared_ptr<JSValue> right) const override {
-    return std::make_shared<JSNumber>(0);
+  struct Function {
+    std::string name;
+    uint64_t calls = 0;
+    // Self cost by ProfileCounter, time in nanoseconds
+    Counters counters {};
   };
   
-  std::shared_ptr<JSValue>
-  minus_operator(std::shared_ptr<JSValue> right) const override {
-    return std::make_shared<JSNumber>(0);
-  };
+  static bool enabled() { return enabled_.load(std::memory_order_relaxed); }
+  static void enable() { enabled_.store(true, std::memory_order_relaxed); }
+  static void disable() { enabled_.store(false, std::memory_order_relaxed); }
   
-  std::shared_ptr<JSBoolean>
-  equalsequalsequals_operator(std::shared_ptr<JSValue> right) const override {
-    return std::make_shared<JSBoolean>(false);
+  // Whether some thread got the hardware counters
+  static bool counters_available() { return counters_available_.load(std::memory_order_relaxed); }
+  
+  // Function entry, see PROFILE_CALL
+  class Call {
+  public:
+    Call(const Identifier &name) : active_(enabled()) {
+      if (active_) {
+        thread_profile().enter(name.trace_name());
+      }
+    }
+    Call(const Call &) = delete;
+    ~Call() {
+      if (active_) {
+        thread_profile().exit();
+      }
+    }
+    
+  private:
+    bool active_;
   };
   
-  std::shared_ptr<JSNumber> as_number() const override {
-    return std::make_shared<JSNumber>(0);
+  // Threads should not be profiling while the results are cleared or read
+  static void clear() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (const auto &thread : threads_) {
+      thread->functions.clear();
+    }
   }
   
-  std::shared_ptr<JSBoolean> as_boolean() const override {
-    return std::make_shared<JSBoolean>(false);
+  // Merged over all threads, the most cycles (or time) first
+  static std::vector<Function> report() {
+    std::map<uint32_t, Function> functions;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      for (const auto &thread : threads_) {
+        for (uint32_t name = 0; name != thread->functions.size(); ++name) {
+          const auto &totals = thread->functions[name];
+          if (totals.calls == 0) {
+            continue;
+          }
+          auto &function = functions[name];
+          function.calls += totals.calls;
+          for (std::size_t i = 0; i != kProfileCounters; ++i) {
+            function.counters[i] += totals.counters[i];
+          }
+        }
+      }
+    }
+    
+    std::vector<Function> result;
+    for (auto &[name, function] : functions) {
+      function.name = Trace::name(name);
+      result.push_back(function);
+    }
+    auto order = counters_available() ? ProfileCounter::Cycles : ProfileCounter::Time;
+    std::stable_sort(result.begin(), result.end(), [order](const Function &a, const Function &b) {
+      return a.counters[std::size_t(order)] > b.counters[std::size_t(order)];
+    });
+    return result;
   }
   
-  std::shared_ptr<JSValue> call(Chain &chain, std::vector<std::shared_ptr<JSValue>> values) const override {
-    throw std::runtime_error(this->serialize() + " is not a function");
+  // The report as a table
+  static void dump(std::ostream &output) {
+    output << std::left << std::setw(24) << "function" << std::right << std::setw(12) << "calls"
+      << std::setw(14) << "time (us)" << std::setw(16) << "cycles" << std::setw(16) << "instructions"
+      << std::setw(14) << "cache misses" << std::setw(14) << "branch misses" << "\n";
+    for (const auto &function : report()) {
+      output << std::left << std::setw(24) << function.name << std::right << std::setw(12) << function.calls
+        << std::setw(14) << function.counters[std::size_t(ProfileCounter::Time)] / 1000;
+      const int widths[] = {16, 16, 14, 14};
+      for (std::size_t i = 1; i != kProfileCounters; ++i) {
+        output << std::setw(widths[i - 1]);
+        if (counters_available()) {
+          output << function.counters[i];
+        } else {
+          output << "-";
+        }
+      }
+      output << "\n";
+    }
   }
-};
-
-class JSUndefined : public JSValue {
-public:
-  std::string serialize() const override { return "undefined"; };
   
-  std::shared_ptr<JSValue>
-  plus_operator(std::shared_ptr<JSValue> right) const override {
-    return std::make_shared<JSNumber>(0);
+private:
+  struct Totals {
+    uint64_t calls = 0;
+    Counters counters {};
   };
   
-  std::shared_ptr<JSValue>
-  minus_operator(std::shared_ptr<JSValue> right) const override {
-    return std::make_shared<JSNumber>(0);
+  struct Activation {
+    uint32_t name;
+    Counters self;
+    // Counters when the function was last on top of the stack
+    Counters resumed;
   };
   
-  std::shared_ptr<JSBoolean>
-  equalsequalsequals_operator(std::shared_ptr<JSValue> right) const override {
-    // @TO-DO: find a better way :-)
-    if (right->serialize() == "undefined") {
-      return std::make_shared<JSBoolean>(true);
+  struct ThreadProfile {
+    // Leader of the group of hardware counters, -1 if there are none
+    int group = -1;
+    std::vector<int> members;
+    // Position of each counter in what the group reads, -1 if it didn't open
+    std::array<int, kProfileCounters> positions {-1, -1, -1, -1, -1};
+    std::size_t opened = 0;
+    
+    std::vector<Activation> stack;
+    // By trace name
+    std::vector<Totals> functions;
+    
+    void open() {
+#ifdef __linux__
+      const uint64_t configs[] = {
+        PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS,
+        PERF_COUNT_HW_CACHE_MISSES, PERF_COUNT_HW_BRANCH_MISSES,
+      };
+      for (std::size_t i = 0; i != 4; ++i) {
+        perf_event_attr attributes {};
+        attributes.type = PERF_TYPE_HARDWARE;
+        attributes.size = sizeof(attributes);
+        attributes.config = configs[i];
+        attributes.exclude_kernel = 1;
+        attributes.exclude_hv = 1;
+        attributes.read_format = PERF_FORMAT_GROUP;
+        auto fd = static_cast<int>(syscall(SYS_perf_event_open, &attributes, 0, -1, group, 0));
+        if (fd == -1) {
+          continue;
+        }
+        if (group == -1) {
+          group = fd;
+        } else {
+          members.push_back(fd);
+        }
+        positions[i + 1] = static_cast<int>(opened++);
+      }
+      if (group != -1) {
+        counters_available_.store(true, std::memory_order_relaxed);
+      }
+#endif
+    }
+    
+    void close() {
+#ifdef __linux__
+      for (auto fd : members) {
+        ::close(fd);
+      }
+      if (group != -1) {
+        ::close(group);
+      }
+#endif
+      members.clear();
+      group = -1;
+    }
+    
+    Counters read() {
+      Counters counters {};
+      counters[std::size_t(ProfileCounter::Time)] = std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+#ifdef __linux__
+      if (group != -1) {
+        // The number of counters, then their values
+        uint64_t values[1 + kProfileCounters] {};
+        if (::read(group, values, sizeof(values)) > 0) {
+          for (std::size_t i = 1; i != kProfileCounters; ++i) {
+            if (positions[i] != -1) {
+              counters[i] = values[1 + positions[i]];
+            }
+          }
+        }
+      }
+#endif
+      return counters;
+    }
+    
+    void enter(uint32_t name) {
+      auto now = read();
+      if (!stack.empty()) {
+        charge(stack.back(), now);
+      }
+      stack.push_back(Activation{name, {}, now});
+    }
+    
+    void exit() {
+      if (stack.empty()) {
+        return;
+      }
+      auto now = read();
+      auto &top = stack.back();
+      charge(top, now);
+      if (functions.size() <= top.name) {
+        functions.resize(top.name + 1);
+      }
+      auto &totals = functions[top.name];
+      ++totals.calls;
+      for (std::size_t i = 0; i != kProfileCounters; ++i) {
+        totals.counters[i] += top.self[i];
+      }
+      stack.pop_back();
+      if (!stack.empty()) {
+        stack.back().resumed = now;
+      }
     }
     
-    return std::make_shared<JSBoolean>(false);
+    static void charge(Activation &activation, const Counters &now) {
+      for (std::size_t i = 0; i != kProfileCounters; ++i) {
+        activation.self[i] += now[i] - activation.resumed[i];
+      }
+    }
   };
   
-  std::shared_ptr<JSNumber> as_number() const override {
-    return std::make_shared<JSNumber>(0);
-  }
-  
-  std::shared_ptr<JSBoolean> as_boolean() const override {
-    return std::make_shared<JSBoolean>(false);
-  }
+  static inline std::atomic<bool> enabled_ {false};
+  static inline std::atomic<bool> counters_available_ {false};
+  static inline std::mutex mutex_;
+  // Kept after their threads exit, so report still sees their results
+  static inline std::vector<std::shared_ptr<ThreadProfile>> threads_;
   
-  std::shared_ptr<JSValue> call(Chain &chain, std::vector<std::shared_ptr<JSValue>> values) const override {
-    throw std::runtime_error("TypeError: undefined not a function.");
+  static ThreadProfile &thread_profile() {
+    // Closes the counters when the thread exits
+    struct Holder {
+      std::shared_ptr<ThreadProfile> profile = std::make_shared<ThreadProfile>();
+      Holder() {
+        profile->open();
+        std::lock_guard<std::mutex> lock(mutex_);
+        threads_.push_back(profile);
+      }
+      ~Holder() { profile->close(); }
+    };
+    thread_local Holder holder;
+    return *holder.profile;
   }
 };
 
-class JSFunction : public JSValue {
+class JSNumber;
+class JSString;
+class JSBoolean;
+class JSObject;
+class JSFunction;
+class JSNativeFunction;
+
+class OutOfMemoryError : public std::runtime_error {
 public:
-  const FunctionDeclaration declaration;
-  Chain local_chain_;
+  OutOfMemoryError() : std::runtime_error("RangeError: out of memory") {};
+};
+
+// Memory of one Context. Values made with Heap::make while a Context runs
+// are charged to its heap, along with the variables of scopes and objects.
+// The heap itself lives until its Context and everything allocated from it
+// is gone. Memory is freed by reference counting, plus collect() for the
+// cycles between scopes and closures.
+//
+// A heap allocates on one thread at a time, the one running its Context. A
+// value can outlive that and be freed on any thread, so the counters are
+// updated with atomic read-modify-writes, and the last free deletes the heap.
+class Heap {
+public:
+  struct Statistics {
+    std::size_t used = 0;
+    std::size_t peak = 0;
+    std::size_t total_allocated = 0;
+    std::array<std::size_t, kHeapCategories> by_category {};
+    // Bytes per second since the previous statistics() call
+    double allocation_rate = 0;
+  };
   
-  JSFunction(const FunctionDeclaration declaration, Chain& local_chain) :
-  declaration(declaration), local_chain_(local_chain) {};
+  // Called when an allocation would go over the soft limit. Returns the new
+  // soft limit; one that doesn't make room turns the soft limit off. Must not
+  // run JS.
+  using NearHeapLimitCallback = std::function<std::size_t(std::size_t used, std::size_t soft_limit)>;
   
-  std::string serialize() const override { return "Function {}"; };
+  // Zero means no limit
+  std::size_t soft_limit = 0;
+  std::size_t hard_limit = 0;
+  NearHeapLimitCallback near_heap_limit_callback;
   
-  std::shared_ptr<JSValue>
-  plus_operator(std::shared_ptr<JSValue> right) const override {
-    return std::make_shared<JSUndefined>();
-  };
+  static Heap *create() { return new Heap(); }
   
-  std::shared_ptr<JSValue>
-  minus_operator(std::shared_ptr<JSValue> right) const override {
-    return std::make_shared<JSUndefined>();
-  };
+  // Called by the owner instead of delete
+  void release() {
+    deallocated(0, HeapCategory::Other);
+  }
   
-  std::shared_ptr<JSBoolean>
-  equalsequalsequals_operator(std::shared_ptr<JSValue> right) const override {
-    return std::make_shared<JSBoolean>(false);
+  static Heap *current() { return current_; }
+  
+  // Makes the heap current for the lifetime of the object
+  class Enter {
+  public:
+    Enter(Heap *heap) : previous_(current_) { current_ = heap; }
+    Enter(const Enter &) = delete;
+    ~Enter() { current_ = previous_; }
+  
+  private:
+    Heap *previous_;
   };
   
-  std::shared_ptr<JSNumber> as_number() const override {
-    return std::make_shared<JSNumber>(0);
+  template <typename T, typename... Arguments>
+  static std::shared_ptr<T> make(Arguments &&... arguments) {
+    if (!current_) {
+      return std::make_shared<T>(std::forward<Arguments>(arguments)...);
+    }
+    return std::allocate_shared<T>(HeapAllocator<T>(current_, category_of<T>()), std::forward<Arguments>(arguments)...);
   }
   
-  std::shared_ptr<JSBoolean> as_boolean() const override {
-    return std::make_shared<JSBoolean>(true);
+  void *allocate(std::size_t bytes, HeapCategory category) {
+    auto used = load(used_) + bytes;
+    if ((hard_limit && used > hard_limit) || (soft_limit && used > soft_limit)) {
+      collect();
+      used = load(used_) + bytes;
+    }
+    if (hard_limit && used > hard_limit) {
+      throw OutOfMemoryError();
+    }
+    if (soft_limit && used > soft_limit) {
+      auto limit = soft_limit;
+      soft_limit = 0;
+      if (near_heap_limit_callback) {
+        auto new_limit = near_heap_limit_callback(used, limit);
+        soft_limit = new_limit >= used ? new_limit : 0;
+      }
+    }
+    
+    auto pointer = ::operator new(bytes);
+    used = used_.fetch_add(bytes, std::memory_order_relaxed) + bytes;
+    auto peak = load(peak_);
+    while (used > peak && !peak_.compare_exchange_weak(peak, used, std::memory_order_relaxed)) {}
+    total_allocated_.fetch_add(bytes, std::memory_order_relaxed);
+    by_category_[static_cast<std::size_t>(category)].fetch_add(bytes, std::memory_order_relaxed);
+    allocations_.fetch_add(1, std::memory_order_relaxed);
+    return pointer;
   }
   
-  std::shared_ptr<JSValue> call(Chain &chain, std::vector<std::shared_ptr<JSValue>> values) const override {
-    auto function_scope = Scope{};
-    
-    for (std::size_t i = 0; i != values.size(); ++i) {
-      auto value = values[i];
-      auto s = declaration.parameters.at(i).name.text;
-      function_scope.values.insert({s, value});
+  void deallocate(void *pointer, std::size_t bytes, HeapCategory category) {
+    ::operator delete(pointer);
+    deallocated(bytes, category);
+  }
+  
+  Statistics statistics() {
+    Statistics result;
+    result.used = load(used_);
+    result.peak = load(peak_);
+    result.total_allocated = load(total_allocated_);
+    for (std::size_t i = 0; i != kHeapCategories; ++i) {
+      result.by_category[i] = load(by_category_[i]);
     }
     
-    log(
-        "JSFunction::call push, name =",
-        declaration.name.text,
-        "function_scope =",
-        function_scope.serialize(),
-        "local_chain =",
-        local_chain_.serialize()
-        );
-    
-    auto new_chain = chain.add(local_chain_).add(function_scope);
-    auto function_return_value = declaration.execute(new_chain);
-    log("JSFunction::call pop, name =", declaration.name.text);
-    
-    return function_return_value;
+    auto now = std::chrono::steady_clock::now();
+    auto seconds = std::chrono::duration<double>(now - rate_time_).count();
+    if (seconds > 0) {
+      result.allocation_rate = (result.total_allocated - rate_total_) / seconds;
+    }
+    rate_time_ = now;
+    rate_total_ = result.total_allocated;
+    return result;
   }
-};
-
-// FunctionDeclaration
-std::shared_ptr<JSValue> FunctionDeclaration::evaluate(Chain &chain) const {
-  log("FunctionDeclaration::evaluate", name.text);
-  auto function_value = std::make_shared<JSFunction>(*this, chain);
-  chain.scopes.back().values.insert({ name.text, function_value });
-  return nullptr;
-}
-std::shared_ptr<JSValue> FunctionDeclaration::execute(Chain &chain) const {
-  log("FunctionDeclaration::execute", name.text);
-  for (const auto &statement : body.statements) {
-    auto value = statement->evaluate(chain);
-    if (value) {
-      return value;
+  
+  // Scopes are tracked to find the cycles between them and the closures
+  // stored in them
+  void track(const std::shared_ptr<Scope> &scope) {
+    if (scopes_.size() == scopes_.capacity() && scopes_.size() >= 64) {
+      prune();
+    }
+    scopes_.push_back(scope);
+  }
+  
+  // Frees the tracked scopes that only cycles keep alive. Returns the number
+  // of bytes freed.
+  std::size_t collect();
+  
+  void clear_scopes() {
+    auto scopes = std::move(scopes_);
+    for (const auto &weak_scope : scopes) {
+      if (auto scope = weak_scope.lock()) {
+        scope->values.clear();
+        scope->parent.reset();
+      }
     }
   }
-  return nullptr;
-}
-StatementKind FunctionDeclaration::getKind() const { return kind; }
 
-std::string FunctionDeclaration::serialize() const {
-  std::string result = "function " + name.text + "(";
+private:
+  static inline thread_local Heap *current_ = nullptr;
   
-  for (const auto& parameter: parameters) {
-    result += parameter.name.text + ", ";
+  std::atomic<std::size_t> used_ {0};
+  std::atomic<std::size_t> peak_ {0};
+  std::atomic<std::size_t> total_allocated_ {0};
+  std::array<std::atomic<std::size_t>, kHeapCategories> by_category_ {};
+  // Live allocations, plus one for the owner
+  std::atomic<std::size_t> allocations_ {1};
+  
+  std::chrono::steady_clock::time_point rate_time_ = std::chrono::steady_clock::now();
+  std::size_t rate_total_ = 0;
+  
+  std::vector<std::weak_ptr<Scope>> scopes_;
+  
+  bool collecting_ = false;
+  
+  Heap() {};
+  
+  void prune() {
+    scopes_.erase(std::remove_if(scopes_.begin(), scopes_.end(), [](const std::weak_ptr<Scope> &scope) {
+      return scope.expired();
+    }), scopes_.end());
+  }
+  
+  template <typename T>
+  static constexpr HeapCategory category_of() {
+    if constexpr (std::is_same_v<T, Scope>) {
+      return HeapCategory::Scope;
+    } else if constexpr (std::is_same_v<T, JSNumber>) {
+      return HeapCategory::Number;
+    } else if constexpr (std::is_same_v<T, JSString>) {
+      return HeapCategory::String;
+    } else if constexpr (std::is_same_v<T, JSBoolean>) {
+      return HeapCategory::Boolean;
+    } else if constexpr (std::is_same_v<T, JSFunction> || std::is_same_v<T, JSNativeFunction>) {
+      return HeapCategory::Function;
+    } else if constexpr (std::is_same_v<T, MemoCache>) {
+      return HeapCategory::Memo;
+    } else if constexpr (std::is_base_of_v<JSObject, T>) {
+      return HeapCategory::Object;
+    } else {
+      return HeapCategory::Other;
+    }
   }
-  result += ") {\n";
   
-  result += body.serialize("  ");
+  void deallocated(std::size_t bytes, HeapCategory category) {
+    used_.fetch_sub(bytes, std::memory_order_relaxed);
+    by_category_[static_cast<std::size_t>(category)].fetch_sub(bytes, std::memory_order_relaxed);
+    // The frees before this one happen before the delete
+    if (allocations_.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+      delete this;
+    }
+  }
   
-  return result + "}";
+  static std::size_t load(const std::atomic<std::size_t> &counter) {
+    return counter.load(std::memory_order_relaxed);
+  }
+};
+
+Heap *current_heap() {
+  return Heap::current();
 }
 
-void Identifier::visit() const { printf("Visit Identifier\n"); }
-std::shared_ptr<JSValue> Identifier::evaluate(Chain &chain) const {
-  auto value = chain.lookup_value(text);
-  log("Identifier::evaluate", text, "=", value->serialize());
-  return value;
+void *heap_allocate(Heap *heap, std::size_t bytes, HeapCategory category) {
+  if (!heap) {
+    return ::operator new(bytes);
+  }
+  return heap->allocate(bytes, category);
 }
 
-std::string Identifier::serialize() const {
-  return text;
+void heap_deallocate(Heap *heap, void *pointer, std::size_t bytes, HeapCategory category) {
+  if (!heap) {
+    ::operator delete(pointer);
+    return;
+  }
+  heap->deallocate(pointer, bytes, category);
 }
 
-class TrueKeyword : public Expression {
+// Thrown at a safepoint when a script runs out of fuel or is interrupted.
+// The stack unwinds to the host and the Context can be used again.
+class TerminationError : public std::runtime_error {
 public:
-  void visit() const override { printf("Visit TrueKeyword\n"); }
-  
-  std::shared_ptr<JSValue> evaluate(Chain &chain) const override {
-    return std::make_shared<JSBoolean>(true);
-  }
-  
-  std::string serialize() const override {
-    return "true";
-  }
+  TerminationError(const std::string &reason) : std::runtime_error("Error: execution terminated, " + reason) {};
 };
 
-class FalseKeyword : public Expression {
+const std::size_t kMaxCallDepth = 2000;
+
+// Native stack left below the deepest call, for the code that runs until
+// the next call and for unwinding. At most a quarter of what was free when
+// the thread first entered a Context.
+const std::size_t kStackMargin = 128 * 1024;
+
+// Lowest address calls may use on the current thread's stack, zero where
+// the platform doesn't tell
+uintptr_t thread_stack_limit() {
+  static thread_local const uintptr_t limit = [] {
+    uintptr_t low = 0;
+#if defined(__linux__)
+    pthread_attr_t attributes;
+    if (pthread_getattr_np(pthread_self(), &attributes) != 0) {
+      return uintptr_t(0);
+    }
+    void *address = nullptr;
+    std::size_t size = 0;
+    pthread_attr_getstack(&attributes, &address, &size);
+    pthread_attr_destroy(&attributes);
+    low = reinterpret_cast<uintptr_t>(address);
+#elif defined(__APPLE__)
+    // The address is the top, stacks grow down
+    auto self = pthread_self();
+    low = reinterpret_cast<uintptr_t>(pthread_get_stackaddr_np(self)) - pthread_get_stacksize_np(self);
+#endif
+    // The thread-local storage may take the top of the stack
+    auto here = reinterpret_cast<uintptr_t>(__builtin_frame_address(0));
+    return low && low < here ? low + std::min<uintptr_t>(kStackMargin, (here - low) / 4) : 0;
+  }();
+  return limit;
+}
+
+// Execution budget of one Context. Fuel is charged one unit at every
+// safepoint: function entry and loop back-edges, compiled loops included.
+// The interrupt flag is the only part other threads may touch.
+class Execution {
 public:
-  void visit() const override { printf("Visit FalseKeyword\n"); }
+  static constexpr int64_t kUnlimited = INT64_MAX;
   
-  std::shared_ptr<JSValue> evaluate(Chain &chain) const override {
-    return std::make_shared<JSBoolean>(false);
-  }
+  // Fuel for each call from the host, see Enter
+  int64_t fuel_limit = kUnlimited;
   
-  std::string serialize() const override {
-    return "false";
-  }
-};
-
-class NumericLiteral : public Expression {
-public:
-  const std::string text;
+  static Execution *current() { return current_; }
   
-  NumericLiteral(const std::string text) : text(text){};
+  // Makes the execution current. The outermost one refuels, so a native
+  // callback calling back into JS doesn't.
+  class Enter {
+  public:
+    Enter(Execution *execution) : previous_(current_) {
+      current_ = execution;
+      if (execution->depth_++ == 0) {
+        execution->fuel_ = execution->fuel_limit;
+        execution->stack_limit_ = thread_stack_limit();
+      }
+    }
+    Enter(const Enter &) = delete;
+    ~Enter() {
+      --current_->depth_;
+      current_ = previous_;
+    }
+    
+  private:
+    Execution *previous_;
+  };
   
-  void visit() const override { printf("Visit NumericLiteral\n"); }
+  // Function entry. Throws before the native stack runs out, or past
+  // kMaxCallDepth calls where the stack bounds are unknown.
+  class Call {
+  public:
+    Call() : execution_(current_) {
+      if (!execution_) {
+        return;
+      }
+      execution_->poll();
+      // Not the address of a local, sanitizers may move those off the stack
+      auto here = reinterpret_cast<uintptr_t>(__builtin_frame_address(0));
+      if (++execution_->call_depth_ > kMaxCallDepth || here < execution_->stack_limit_) {
+        --execution_->call_depth_;
+        throw std::runtime_error("RangeError: Maximum call stack size exceeded");
+      }
+    }
+    Call(const Call &) = delete;
+    ~Call() {
+      if (execution_) {
+        --execution_->call_depth_;
+      }
+    }
+    
+  private:
+    Execution *execution_;
+  };
   
-  std::shared_ptr<JSValue> evaluate(Chain &chain) const override {
-    return std::make_shared<JSNumber>(std::stod(text));
+  // Loop back-edge
+  static void safepoint() {
+    if (current_) {
+      current_->poll();
+    }
   }
   
-  std::string serialize() const override {
-    return text;
+  // Stops the running script at its next safepoint, or the next one to run.
+  // Safe to call from any thread.
+  void interrupt() {
+    interrupt_requested_.store(true, std::memory_order_relaxed);
   }
-};
-
-class BinaryExpression : public Expression {
-public:
-  const std::shared_ptr<Expression> left;
-  const std::shared_ptr<Expression> right;
-  const Token operatorToken;
   
-  BinaryExpression(const std::shared_ptr<Expression> left, const Token operatorToken,
-                   const std::shared_ptr<Expression> right)
-  : left(left), right(right), operatorToken(operatorToken) {};
+private:
+  static inline thread_local Execution *current_ = nullptr;
   
-  void visit() const override {
-    printf("Visit BinaryExpression\n");
-    left->visit();
-    right->visit();
-  }
+  int64_t fuel_ = kUnlimited;
+  std::size_t depth_ = 0;
+  // Of the thread that entered, see thread_stack_limit
+  uintptr_t stack_limit_ = 0;
+  std::size_t call_depth_ = 0;
+  std::atomic<bool> interrupt_requested_ {false};
   
-  std::shared_ptr<JSValue> evaluate(Chain &chain) const override {
-    log("BinaryExpression::evaluate");
-    switch (operatorToken) {
-      case Token::Plus: {
-        auto left_value = left->evaluate(chain);
-        auto right_value = right->evaluate(chain);
-        return left_value->plus_operator(std::move(right_value));
-      }
-      case Token::Minus: {
-        auto left_value = left->evaluate(chain);
-        auto right_value = right->evaluate(chain);
-        return left_value->minus_operator(std::move(right_value));
-      }
-      case Token::EqualsEqualsEquals: {
-        auto left_value = left->evaluate(chain);
-        auto right_value = right->evaluate(chain);
-        return left_value->equalsequalsequals_operator(std::move(right_value));
-      }
+  void poll() {
+    if (--fuel_ < 0 || interrupt_requested_.load(std::memory_order_relaxed)) {
+      terminate();
     }
   }
   
-  std::string serialize() const override {
-    std::string result = left->serialize();
-    
-    switch (operatorToken) {
-      case Token::Plus: result += " + "; break;
-      case Token::Minus: result += " - "; break;
-      case Token::EqualsEqualsEquals: result += " === "; break;
+  [[noreturn]] void terminate() {
+    if (interrupt_requested_.exchange(false, std::memory_order_relaxed)) {
+      throw TerminationError("interrupted");
     }
-    
-    return result + right->serialize();
+    fuel_ = 0;
+    throw TerminationError("out of fuel");
   }
 };
 
-class ConditionalExpression : public Expression {
-public:
-  const std::shared_ptr<Expression> condition;
-  const std::shared_ptr<Expression> whenTrue;
-  const std::shared_ptr<Expression> whenFalse;
-  
-  ConditionalExpression(const std::shared_ptr<Expression> condition, const std::shared_ptr<Expression> whenTrue,
-                        const std::shared_ptr<Expression> whenFalse)
-  : condition(condition), whenTrue(whenTrue), whenFalse(whenFalse){};
+// std::to_chars for double is only in Apple's libc++ from macOS 13.3. For
+// older deployment targets the digits come from snprintf instead.
+#ifndef NOTJS_TO_CHARS_DOUBLE
+#if defined(__ENVIRONMENT_MAC_OS_X_VERSION_MIN_REQUIRED__) && __ENVIRONMENT_MAC_OS_X_VERSION_MIN_REQUIRED__ < 130300
+#define NOTJS_TO_CHARS_DOUBLE 0
+#else
+#define NOTJS_TO_CHARS_DOUBLE 1
+#endif
+#endif
+
+// Number::toString from the spec. The digits come from std::to_chars, which
+// gives the shortest representation that round-trips.
+std::string number_to_string(double value) {
+  if (std::isnan(value)) {
+    return "NaN";
+  }
+  if (value == 0) {
+    return "0";
+  }
+  if (value < 0) {
+    return "-" + number_to_string(-value);
+  }
+  if (std::isinf(value)) {
+    return "Infinity";
+  }
   
-  void visit() const override { printf("Visit ConditionalExpression\n"); }
+  // d.ddde+x
+  char buffer[32];
+#if NOTJS_TO_CHARS_DOUBLE
+  auto end = std::to_chars(buffer, buffer + sizeof(buffer) - 1, value, std::chars_format::scientific).ptr;
+  *end = '\0';
+#else
+  // The shortest precision that round-trips, 17 digits always do
+  for (int precision = 0; precision <= 16; ++precision) {
+    snprintf(buffer, sizeof(buffer), "%.*e", precision, value);
+    if (strtod(buffer, nullptr) == value) {
+      break;
+    }
+  }
+  auto end = buffer + strlen(buffer);
+#endif
+  auto e = std::find(buffer, end, 'e');
   
-  std::shared_ptr<JSValue> evaluate(Chain &chain) const override {
-    log("ConditionalExpression::evaluate");
-    bool result = condition->evaluate(chain)->as_boolean()->value;
-    
-    if (result) {
-      return whenTrue->evaluate(chain);
-    } else {
-      return whenFalse->evaluate(chain);
+  std::string digits;
+  for (auto c = buffer; c != e; ++c) {
+    if (*c != '.') {
+      digits += *c;
     }
   }
+  int k = int(digits.size());
+  int n = atoi(e + 1) + 1;
   
-  std::string serialize() const override {
-    return "ConditionalExpression";
+  if (k <= n && n <= 21) {
+    return digits + std::string(n - k, '0');
   }
-};
+  if (0 < n && n <= 21) {
+    return digits.substr(0, n) + "." + digits.substr(n);
+  }
+  if (-6 < n && n <= 0) {
+    return "0." + std::string(-n, '0') + digits;
+  }
+  
+  auto exponent = std::string("e") + (n - 1 < 0 ? "-" : "+") + std::to_string(abs(n - 1));
+  if (k == 1) {
+    return digits + exponent;
+  }
+  return digits.substr(0, 1) + "." + digits.substr(1) + exponent;
+}
 
-class CallExpression : public Expression {
+class JSNumber : public JSValue {
 public:
-  const std::shared_ptr<Expression> expression;
-  const std::vector<std::shared_ptr<Expression>> arguments;
+  const double value;
   
-  CallExpression(const std::shared_ptr<Expression> expression,
-                 const std::vector<std::shared_ptr<Expression>> arguments)
-  : expression(expression), arguments(arguments){};
+  std::string serialize() const override { return number_to_string(value); };
   
-  void visit() const override { printf("Visit CallExpression\n"); }
+  JSNumber(double value) : JSValue(JSType::Number), value(value){};
   
-  std::shared_ptr<JSValue> evaluate(Chain &chain) const override {
-    std::vector<std::shared_ptr<JSValue>> values{};
-    
-    for (const auto& argument : arguments) {
-      auto value = argument->evaluate(chain);
-      values.push_back(value);
-    }
-    
-    log("CallExpression::evaluate,", values.size(), "argument(s)");
-    
-    auto value = expression->evaluate(chain);
-    
-    log("CallExpression::evaluate, got value", value->serialize());
-    
-    return value->call(chain, values);
-  }
+  std::shared_ptr<JSValue>
+  plus_operator(std::shared_ptr<JSValue> right) const override {
+    return Heap::make<JSNumber>(value + right->as_number()->value);
+  };
   
-  std::string serialize() const override {
-    std::string result = expression->serialize() + "(";
-    
-    for (const auto& argument : arguments) {
-      result += argument->serialize() + ", ";
-    }
-    
-    return result + ")";
-  }
-};
-
-class IfStatement : public Statement {
-public:
-  const StatementKind kind;
-  const Block thenStatement;
-  const BinaryExpression expression;
+  std::shared_ptr<JSValue>
+  minus_operator(std::shared_ptr<JSValue> right) const override {
+    return Heap::make<JSNumber>(value - right->as_number()->value);
+  };
   
-  IfStatement(const BinaryExpression expression, const Block thenStatement)
-  : kind(StatementKind::If), thenStatement(thenStatement),
-  expression(expression){};
+  std::shared_ptr<JSBoolean>
+  equalsequalsequals_operator(std::shared_ptr<JSValue> right) const override {
+    bool res = fabs(value - right->as_number()->value) < 0.0001f;
+    return Heap::make<JSBoolean>(res);
+  };
   
-  std::shared_ptr<JSValue> evaluate(Chain &chain) const override {
-    auto value = expression.evaluate(chain);
-    
-    if (value->as_boolean()->value) {
-      for (auto &statement : thenStatement.statements) {
-        return statement->evaluate(chain);
-      }
-    }
-    
-    return nullptr;
+  std::shared_ptr<JSBoolean>
+  lessthan_operator(std::shared_ptr<JSValue> right) const override {
+    return Heap::make<JSBoolean>(value < right->as_number()->value);
+  };
+  
+  std::shared_ptr<JSNumber> as_number() const override {
+    return Heap::make<JSNumber>(*this);
   }
   
-  StatementKind getKind() const override { return kind; }
+  std::shared_ptr<JSBoolean> as_boolean() const override {
+    return Heap::make<JSBoolean>(true);
+  }
   
-  std::string serialize() const override {
-    return "if (" + expression.serialize() + ") {\n" + thenStatement.serialize("  ") + "}";
+  std::shared_ptr<JSValue> call(Chain &chain, std::vector<std::shared_ptr<JSValue>> values) const override {
+    throw std::runtime_error(this->serialize() + " is not a function");
   }
 };
 
-std::string Block::serialize(const std::string offset) const {
-  std::string result = "";
+class JSBoolean : public JSValue {
+public:
+  const bool value;
   
-  for (const auto& statement: statements) {
-    result += offset + statement->serialize() + ";\n";
+  std::string serialize() const override { return value ? "true" : "false"; };
+  
+  JSBoolean(const bool value) : JSValue(JSType::Boolean), value(value){};
+  
+  // Booleans are immutable, so the fast paths share these two
+  static std::shared_ptr<JSBoolean> from(bool value) {
+    static const auto true_value = std::make_shared<JSBoolean>(true);
+    static const auto false_value = std::make_shared<JSBoolean>(false);
+    return value ? true_value : false_value;
   }
   
-  return result;
-};
-
-class ReturnStatement : public Statement {
-public:
-  const StatementKind kind;
-  const std::shared_ptr<Expression> expression;
+  std::shared_ptr<JSValue>
+  plus_operator(std::shared_ptr<JSValue> right) const override {
+    return Heap::make<JSNumber>(value + right->as_number()->value);
+  };
   
-  ReturnStatement(const std::shared_ptr<Expression> expression)
-  : kind(StatementKind::Return), expression(expression){};
+  std::shared_ptr<JSValue>
+  minus_operator(std::shared_ptr<JSValue> right) const override {
+    return Heap::make<JSNumber>(value - right->as_number()->value);
+  };
   
-  std::shared_ptr<JSValue> evaluate(Chain &chain) const override {
-    log("ReturnStatement::evaluate");
-    return expression->evaluate(chain);
+  std::shared_ptr<JSBoolean>
+  equalsequalsequals_operator(std::shared_ptr<JSValue> right) const override {
+    return from(right->type == JSType::Boolean && static_cast<const JSBoolean &>(*right).value == value);
+  };
+  
+  std::shared_ptr<JSBoolean>
+  lessthan_operator(std::shared_ptr<JSValue> right) const override {
+    return Heap::make<JSBoolean>(value < right->as_number()->value);
+  };
+  
+  std::shared_ptr<JSNumber> as_number() const override {
+    return Heap::make<JSNumber>(0);
   }
   
-  StatementKind getKind() const override { return kind; }
+  std::shared_ptr<JSBoolean> as_boolean() const override {
+    return Heap::make<JSBoolean>(*this);
+  }
   
-  std::string serialize() const override {
-    return "return " + expression->serialize();
+  std::shared_ptr<JSValue> call(Chain &chain, std::vector<std::shared_ptr<JSValue> > values) const override {
+    throw std::runtime_error(this->serialize() + " is not a function");
   }
 };
 
-struct VariableDeclaration {
-  const Identifier name;
-  const std::shared_ptr<Expression> initializer;
-};
-
-struct VariableDeclarationList {
-  const std::vector<VariableDeclaration> declarations;
-};
+// ToBoolean, without allocating when the value already is a boolean
+bool is_truthy(const std::shared_ptr<JSValue> &value) {
+  if (value->type == JSType::Boolean) {
+    return static_cast<const JSBoolean &>(*value).value;
+  }
+  return value->as_boolean()->value;
+}
 
-class VariableStatement : public Statement {
+class JSString : public JSValue {
 public:
-  const StatementKind kind_;
-  const VariableDeclarationList declarationList_;
+  const std::string value;
   
-  VariableStatement(const VariableDeclarationList declarationList)
-  : kind_(StatementKind::VariableStatement), declarationList_(declarationList) {};
+  JSString(const std::string value) : JSValue(JSType::String), value(value){};
   
-  std::shared_ptr<JSValue> evaluate(Chain &chain) const override {
-    log("ReturnStatement::evaluate");
-    
-    for (const auto& declaration: declarationList_.declarations) {
-      chain.set_value(declaration.name.text, declaration.initializer->evaluate(chain));
-    }
-    
-    return nullptr;
+  std::string serialize() const override { return value; };
+  
+  std::shared_ptr<JSValue>
+  plus_operator(std::shared_ptr<JSValue> right) const override {
+    return Heap::make<JSNumber>(0);
+  };
+  
+  std::shared_ptr<JSValue>
+  minus_operator(std::shared_ptr<JSValue> right) const override {
+    return Heap::make<JSNumber>(0);
+  };
+  
+  std::shared_ptr<JSBoolean>
+  equalsequalsequals_operator(std::shared_ptr<JSValue> right) const override {
+    return Heap::make<JSBoolean>(false);
+  };
+  
+  std::shared_ptr<JSBoolean>
+  lessthan_operator(std::shared_ptr<JSValue> right) const override {
+    return Heap::make<JSBoolean>(false);
+  };
+  
+  std::shared_ptr<JSNumber> as_number() const override {
+    return Heap::make<JSNumber>(0);
   }
   
-  StatementKind getKind() const override { return kind_; }
+  std::shared_ptr<JSBoolean> as_boolean() const override {
+    return Heap::make<JSBoolean>(false);
+  }
   
-  std::string serialize() const override {
-    return "VariableStatement";
+  std::shared_ptr<JSValue> call(Chain &chain, std::vector<std::shared_ptr<JSValue>> values) const override {
+    throw std::runtime_error(this->serialize() + " is not a function");
   }
 };
 
-class SourceFile {
+class JSUndefined : public JSValue {
 public:
-  const std::string fileName;
-  std::vector<std::shared_ptr<Statement>> statements;
+  JSUndefined() : JSValue(JSType::Undefined) {};
   
-  void evaluate(Chain &chain) const {
-    log("SourceFile::evaluate");
-    for (const auto &statement : statements) {
-      statement->evaluate(chain);
-    }
-  }
+  std::string serialize() const override { return "undefined"; };
   
-  std::string serialize() {
-    std::string result = "";
-    
-    for (const auto &statement : statements) {
-      result += statement->serialize() + "\n";
+  std::shared_ptr<JSValue>
+  plus_operator(std::shared_ptr<JSValue> right) const override {
+    return Heap::make<JSNumber>(0);
+  };
+  
+  std::shared_ptr<JSValue>
+  minus_operator(std::shared_ptr<JSValue> right) const override {
+    return Heap::make<JSNumber>(0);
+  };
+  
+  std::shared_ptr<JSBoolean>
+  equalsequalsequals_operator(std::shared_ptr<JSValue> right) const override {
+    // @TO-DO: find a better way :-)
+    if (right->serialize() == "undefined") {
+      return Heap::make<JSBoolean>(true);
     }
     
-    return result;
+    return Heap::make<JSBoolean>(false);
+  };
+  
+  std::shared_ptr<JSBoolean>
+  lessthan_operator(std::shared_ptr<JSValue> right) const override {
+    return Heap::make<JSBoolean>(false);
+  };
+  
+  std::shared_ptr<JSNumber> as_number() const override {
+    return Heap::make<JSNumber>(0);
+  }
+  
+  std::shared_ptr<JSBoolean> as_boolean() const override {
+    return Heap::make<JSBoolean>(false);
+  }
+  
+  std::shared_ptr<JSValue> call(Chain &chain, std::vector<std::shared_ptr<JSValue>> values) const override {
+    throw std::runtime_error("TypeError: undefined not a function.");
   }
 };
 
-void Chain::load(const SourceFile &sourceFile) {
-  sourceFile.evaluate(*this);
-}
-
-Chain Chain::add(const Chain& chain) const {
-  auto result = Chain{};
-  result.scopes.insert(result.scopes.end(), this->scopes.begin(), this->scopes.end());
-  result.scopes.insert(result.scopes.end(), chain.scopes.begin(), chain.scopes.end());
-  return result;
-}
-
-Chain Chain::add(const Scope& scope) const {
-  auto result = Chain{};
-  result.scopes.insert(result.scopes.end(), this->scopes.begin(), this->scopes.end());
-  result.scopes.push_back(scope);
-  return result;
-}
-
-std::string Scope::serialize() const {
-  std::string result = "Scope {";
+// Reusable stack region for the variables of frames. Each Context has one,
+// charged to its heap; code running outside of a Context uses one per
+// thread.
+class FrameStack {
+public:
+  using Slots = std::vector<std::shared_ptr<JSValue>, HeapAllocator<std::shared_ptr<JSValue>>>;
   
-  bool first = true;
-  for (const auto &value : values) {
-    if (!first) {
-      result += ", ";
+  Slots slots;
+  std::size_t top = 0;
+  
+  FrameStack(Heap *heap = nullptr) : slots(Slots::allocator_type(heap, HeapCategory::Frame)) {};
+  FrameStack(const FrameStack &) = delete;
+  
+  static FrameStack &current() {
+    if (current_) {
+      return *current_;
     }
-    result += value.first + " = " + value.second->serialize();
-    first = false;
+    thread_local FrameStack stack;
+    return stack;
   }
   
-  return result + "}";
+  // Makes the stack current for the lifetime of the object
+  class Enter {
+  public:
+    Enter(FrameStack *stack) : previous_(current_) { current_ = stack; }
+    Enter(const Enter &) = delete;
+    ~Enter() { current_ = previous_; }
+  
+  private:
+    FrameStack *previous_;
+  };
+  
+private:
+  static inline thread_local FrameStack *current_ = nullptr;
 };
 
-std::string Chain::serialize() const {
-  std::string result = "Chain {";
+// Variables of a function call whose scope no closure captures. They live on
+// the FrameStack, so once it has grown such calls don't allocate.
+class Frame {
+public:
+  const std::vector<std::string> &names;
   
-  bool first = true;
-  for (const auto& scope: scopes) {
-    if (!first) {
-      result += ", ";
+  Frame(const std::vector<std::string> &names)
+  : names(names), stack_(FrameStack::current()), base_(stack_.top) {
+    // Grows before taking the slots, the heap may be out of memory
+    auto top = base_ + names.size();
+    if (stack_.slots.size() < top) {
+      stack_.slots.resize(std::max(top, stack_.slots.size() * 2));
     }
-    result += scope.serialize();
-    first = false;
+    stack_.top = top;
   }
   
-  return result + "}";
-};
-
-std::shared_ptr<JSValue> Chain::lookup_value(const std::string name) const {
-  for (std::vector<Scope>::const_reverse_iterator i = scopes.rbegin(); i != scopes.rend(); ++i) {
-    auto scope = *i;
-    auto it = scope.values.find(name);
-    if (it != scope.values.end()) {
-      return it->second;
+  Frame(const Frame &) = delete;
+  
+  ~Frame() {
+    for (std::size_t i = 0; i != names.size(); ++i) {
+      slot(i).reset();
     }
+    stack_.top = base_;
   }
-  return std::make_shared<JSUndefined>();
-}
-
-void Chain::set_value(const std::string name, std::shared_ptr<JSValue> value) {
-  scopes.back().values.insert({ name, value });
-}
-
-// see js/fib.js
-SourceFile createFibonacciProgram() {
-  // fib
-  auto identifier_fib = Identifier{"fib"};
-  auto parameter_n = Parameter{Identifier{"n"}};
   
-  auto first_if_block = Block({ std::make_shared<ReturnStatement>(std::make_shared<NumericLiteral>("1")) });
-  auto first_if_condition = BinaryExpression { std::make_shared<Identifier>("n"), Token::EqualsEqualsEquals, std::make_shared<NumericLiteral>("1") };
+  // Don't keep the reference around, a deeper frame may grow the stack
+  std::shared_ptr<JSValue> &slot(std::size_t index) {
+    return stack_.slots[base_ + index];
+  }
   
-  auto second_if_block = Block({ std::make_shared<ReturnStatement>(std::make_shared<NumericLiteral>("1")) });
-  auto second_if_condition = BinaryExpression { std::make_shared<Identifier>("n"), Token::EqualsEqualsEquals, std::make_shared<NumericLiteral>("2") };
+  // Index of the variable or -1 if it's not declared in this frame
+  int find(const std::string &name) const {
+    for (std::size_t i = 0; i != names.size(); ++i) {
+      if (names[i] == name) {
+        return int(i);
+      }
+    }
+    return -1;
+  }
   
-  std::vector<std::shared_ptr<Expression>> fib_arguments_left {
-    std::make_shared<BinaryExpression>(std::make_shared<Identifier>("n"), Token::Minus, std::make_shared<NumericLiteral>("1"))
-  };
-  auto binary_left = std::make_shared<CallExpression>(std::make_shared<Identifier>("fib"), fib_arguments_left);
+  std::string serialize() const {
+    std::string result = "Frame {";
+    
+    for (std::size_t i = 0; i != names.size(); ++i) {
+      if (i != 0) {
+        result += ", ";
+      }
+      auto value = stack_.slots[base_ + i];
+      result += names[i] + " = " + (value ? value->serialize() : "undefined");
+    }
+    
+    return result + "}";
+  }
   
-  std::vector<std::shared_ptr<Expression>> fib_arguments_right {
-    std::make_shared<BinaryExpression>(std::make_shared<Identifier>("n"), Token::Minus, std::make_shared<NumericLiteral>("2"))
+private:
+  FrameStack &stack_;
+  std::size_t base_;
+};
+
+// Memoization
+//
+// Results of a pure function (see PurityAnalysis) by the values of its
+// arguments, turned on with Context::memoize. Holds up to capacity results
+// and evicts the least recently used one.
+class MemoCache {
+public:
+  struct Statistics {
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+    uint64_t evictions = 0;
+    // Calls with an argument that isn't a primitive, these aren't cached
+    uint64_t bypassed = 0;
+    std::size_t size = 0;
+    std::size_t capacity = 0;
   };
-  auto binary_right = std::make_shared<CallExpression>(std::make_shared<Identifier>("fib"), fib_arguments_right);
   
-  auto sum = std::make_shared<BinaryExpression>(binary_left, Token::Plus, binary_right);
+  const std::size_t capacity;
   
-  auto function_declaration_fib = FunctionDeclaration {
-    identifier_fib,
-    Block({
-      std::make_shared<IfStatement>(first_if_condition, first_if_block),
-      std::make_shared<IfStatement>(second_if_condition, second_if_block),
-      std::make_shared<ReturnStatement>(sum),
-    }),
-    {parameter_n}
-  };
+  // The entries are charged to the current heap
+  MemoCache(std::size_t capacity) : capacity(std::max<std::size_t>(capacity, 1)) {};
   
-  // main
-  auto identifier_main = Identifier{"main"};
-  std::vector<std::shared_ptr<Expression>> args = {std::make_shared<NumericLiteral>("25")};
-  auto ce = std::make_shared<CallExpression>(std::make_shared<Identifier>("fib"), args);
-  auto function_declaration_main = FunctionDeclaration {
-    identifier_main,
-    Block({ std::make_shared<ReturnStatement>(ce) }),
-    {}
+  // Appends the first count arguments to key, missing ones are undefined.
+  // False if one of them isn't a primitive.
+  bool key(const std::vector<std::shared_ptr<JSValue>> &values, std::size_t count, std::string &key) {
+    for (std::size_t i = 0; i != count; ++i) {
+      const JSValue *value = i < values.size() ? values[i].get() : nullptr;
+      auto type = value ? value->type : JSType::Undefined;
+      key += static_cast<char>(type);
+      switch (type) {
+        case JSType::Undefined:
+          break;
+        case JSType::Boolean:
+          key += static_cast<const JSBoolean *>(value)->value ? '1' : '0';
+          break;
+        case JSType::Number: {
+          auto number = static_cast<const JSNumber *>(value)->value;
+          key.append(reinterpret_cast<const char *>(&number), sizeof(number));
+          break;
+        }
+        case JSType::String: {
+          const auto &string = static_cast<const JSString *>(value)->value;
+          auto size = string.size();
+          key.append(reinterpret_cast<const char *>(&size), sizeof(size));
+          key += string;
+          break;
+        }
+        default:
+          ++statistics_.bypassed;
+          return false;
+      }
+    }
+    return true;
+  }
+  
+  std::shared_ptr<JSValue> find(const std::string &key) {
+    auto it = index_.find(std::string_view(key));
+    if (it == index_.end()) {
+      ++statistics_.misses;
+      return nullptr;
+    }
+    ++statistics_.hits;
+    entries_.splice(entries_.begin(), entries_, it->second);
+    return it->second->value;
+  }
+  
+  void insert(const std::string &key, std::shared_ptr<JSValue> value) {
+    // A recursive call may have got there first
+    if (index_.count(std::string_view(key))) {
+      return;
+    }
+    entries_.push_front(Entry{Key(key.data(), key.size(), entries_.get_allocator()), value});
+    index_.insert({entries_.front().view(), entries_.begin()});
+    if (entries_.size() > capacity) {
+      index_.erase(entries_.back().view());
+      entries_.pop_back();
+      ++statistics_.evictions;
+    }
+  }
+  
+  // Drops the results, the statistics stay
+  void clear() {
+    entries_.clear();
+    index_.clear();
+  }
+  
+  Statistics statistics() const {
+    auto result = statistics_;
+    result.size = entries_.size();
+    result.capacity = capacity;
+    return result;
+  }
+  
+private:
+  using Key = std::basic_string<char, std::char_traits<char>, HeapAllocator<char>>;
+  
+  struct Entry {
+    Key key;
+    std::shared_ptr<JSValue> value;
+    
+    std::string_view view() const { return std::string_view(key.data(), key.size()); }
   };
   
-  auto source_file = SourceFile{ "./js/fib.js" };
-  source_file.statements.push_back(std::make_shared<FunctionDeclaration>(function_declaration_fib));
-  source_file.statements.push_back(std::make_shared<FunctionDeclaration>(function_declaration_main));
+  using Entries = std::list<Entry, HeapAllocator<Entry>>;
+  // Keys point into the entries, which don't move
+  using Index = std::unordered_map<std::string_view, Entries::iterator, std::hash<std::string_view>,
+    std::equal_to<std::string_view>, HeapAllocator<std::pair<const std::string_view, Entries::iterator>>>;
   
-  return source_file;
-}
+  // Most recently used first
+  Entries entries_ { Entries::allocator_type(HeapCategory::Memo) };
+  Index index_ { 0, Index::hasher(), Index::key_equal(), Index::allocator_type(HeapCategory::Memo) };
+  Statistics statistics_;
+};
 
-// see js/let.js
-SourceFile createLetProgram() {
-  auto source_file = SourceFile{ "./js/let.js" };
+class JSFunction;
+
+// Calling a generator function, see JSGenerator
+std::shared_ptr<JSValue> create_generator(const JSFunction &function, std::vector<std::shared_ptr<JSValue>> values);
+
+class JSFunction : public JSValue {
+public:
+  // Shared with the program, not copied per closure
+  const std::shared_ptr<const FunctionDeclaration> declaration;
+  Chain local_chain_;
+  // Set by Context::memoize
+  std::shared_ptr<MemoCache> memo;
   
-  auto let_a = std::make_shared<VariableStatement>(VariableDeclarationList {{
-    VariableDeclaration { Identifier { "a" }, std::make_shared<NumericLiteral>("1") }
-  }});
-  source_file.statements.push_back(let_a);
+  JSFunction(std::shared_ptr<const FunctionDeclaration> declaration, const Chain& local_chain) :
+  JSValue(JSType::Function), declaration(declaration), local_chain_(local_chain) {};
   
-  auto let_b = std::make_shared<VariableStatement>(VariableDeclarationList {{
-    VariableDeclaration { Identifier { "b" }, std::make_shared<NumericLiteral>("2") }
-  }});
-  source_file.statements.push_back(let_b);
+  std::string serialize() const override { return "Function {}"; };
   
-  auto function_declaration_main = FunctionDeclaration {
-    Identifier { "main" },
-    Block({ std::make_shared<ReturnStatement>(std::make_shared<BinaryExpression>(std::make_shared<Identifier>("a"), Token::Plus, std::make_shared<Identifier>("b"))) }),
-    {}
+  std::shared_ptr<JSValue>
+  plus_operator(std::shared_ptr<JSValue> right) const override {
+    return Heap::make<JSUndefined>();
   };
-  source_file.statements.push_back(std::make_shared<FunctionDeclaration>(function_declaration_main));
   
-  return source_file;
-}
-
-// see js/closure.js
-SourceFile createClosureProgram() {
-  auto source_file = SourceFile{ "./js/closure.js" };
+  std::shared_ptr<JSValue>
+  minus_operator(std::shared_ptr<JSValue> right) const override {
+    return Heap::make<JSUndefined>();
+  };
   
-  // inner
-  auto function_declaration_inner = FunctionDeclaration {
-    Identifier { "inner" },
-    Block({
-      std::make_shared<ReturnStatement>(std::make_shared<BinaryExpression>(std::make_shared<Identifier>("a"), Token::Plus, std::make_shared<Identifier>("b")))
-    }),
-    {
-      Parameter{ Identifier{ "b" } }
-    }
+  std::shared_ptr<JSBoolean>
+  equalsequalsequals_operator(std::shared_ptr<JSValue> right) const override {
+    return Heap::make<JSBoolean>(false);
   };
   
-  // sum
-  auto function_declaration_sum = FunctionDeclaration {
-    Identifier { "sum" },
-    Block({
-      std::make_shared<FunctionDeclaration>(function_declaration_inner),
-      std::make_shared<ReturnStatement>(std::make_shared<Identifier>("inner"))
-    }),
-    {
-      Parameter{ Identifier{ "a" } }
-    }
+  std::shared_ptr<JSBoolean>
+  lessthan_operator(std::shared_ptr<JSValue> right) const override {
+    return Heap::make<JSBoolean>(false);
   };
-  source_file.statements.push_back(std::make_shared<FunctionDeclaration>(function_declaration_sum));
   
-  // main
-  std::vector<std::shared_ptr<Expression>> args_inner = {std::make_shared<NumericLiteral>("40")};
-  auto call_expression_inner = std::make_shared<CallExpression>(std::make_shared<Identifier>("sum"), args_inner);
+  std::shared_ptr<JSNumber> as_number() const override {
+    return Heap::make<JSNumber>(0);
+  }
   
-  std::vector<std::shared_ptr<Expression>> args_outer = {std::make_shared<NumericLiteral>("2")};
-  auto call_expression_outer = std::make_shared<CallExpression>(call_expression_inner, args_outer);
+  std::shared_ptr<JSBoolean> as_boolean() const override {
+    return Heap::make<JSBoolean>(true);
+  }
   
-  auto function_declaration_main = FunctionDeclaration {
-    Identifier { "main" },
-    Block({ std::make_shared<ReturnStatement>(call_expression_outer) }),
-    {}
-  };
-  source_file.statements.push_back(std::make_shared<FunctionDeclaration>(function_declaration_main));
+  std::shared_ptr<JSValue> call(Chain &chain, std::vector<std::shared_ptr<JSValue>> values) const override {
+    if (declaration->is_generator) {
+      return create_generator(*this, std::move(values));
+    }
+    if (memo) {
+      return call_memoized(std::move(values));
+    }
+    return invoke(std::move(values));
+  }
   
-  return source_file;
-}
+private:
+  std::shared_ptr<JSValue> call_memoized(std::vector<std::shared_ptr<JSValue>> values) const {
+    std::string key;
+    if (!memo->key(values, declaration->parameters.size(), key)) {
+      return invoke(std::move(values));
+    }
+    if (auto value = memo->find(key)) {
+      return value;
+    }
+    auto value = invoke(std::move(values));
+    memo->insert(key, value);
+    return value;
+  }
+  
+  std::shared_ptr<JSValue> invoke(std::vector<std::shared_ptr<JSValue>> values) const {
+    Execution::Call call;
+    TRACE_CALL(declaration->name, values.size());
+    PROFILE_CALL(declaration->name);
+    
+    const auto &locals = declaration->locals();
+    auto new_chain = local_chain_;
+    std::shared_ptr<JSValue> function_return_value;
+    
+    if (declaration->is_scope_captured()) {
+      auto function_scope = Heap::make<Scope>();
+      if (auto heap = Heap::current()) {
+        heap->track(function_scope);
+      }
+      TRACE_EVENT(TraceKind::Allocation, Trace::scope_name(), sizeof(Scope));
+      function_scope->parent = local_chain_.scope;
+      for (std::size_t i = 0; i != declaration->parameters.size(); ++i) {
+        auto value = i < values.size() ? values[i] : Heap::make<JSUndefined>();
+        function_scope->values.insert({locals[i], value});
+      }
+      new_chain.scope = function_scope;
+      
+      TRACE_LOG("JSFunction::call push, name =", declaration->name.text, "chain =", new_chain.serialize());
+      function_return_value = declaration->execute(new_chain);
+    } else {
+      Frame frame(locals);
+      for (std::size_t i = 0; i != std::min(values.size(), declaration->parameters.size()); ++i) {
+        frame.slot(i) = values[i];
+      }
+      new_chain.frame = &frame;
+      
+      TRACE_LOG("JSFunction::call push, name =", declaration->name.text, "chain =", new_chain.serialize());
+      function_return_value = declaration->execute(new_chain);
+    }
+    
+    TRACE_LOG("JSFunction::call pop, name =", declaration->name.text);
+    
+    if (!function_return_value) {
+      return Heap::make<JSUndefined>();
+    }
+    return function_return_value;
+  }
+};
 
-// see js/list.js
-SourceFile createListProgram() {
-  auto source_file = SourceFile{ "./js/list.js" };
+// Trial deletion over the tracked scopes and the closures stored in them:
+// a node is alive if it has more references than the ones coming from other
+// nodes, or if an alive node refers to it. References from anywhere else
+// (frames, objects, the event loop) count as outside ones, so everything
+// they reach is kept.
+std::size_t Heap::collect() {
+  if (collecting_) {
+    return 0;
+  }
+  collecting_ = true;
+  auto before = load(used_);
+  prune();
   
-  // inner
-  std::vector<std::shared_ptr<Expression>> args_getter = {
-    std::make_shared<Identifier>("a"),
-    std::make_shared<Identifier>("b")
+  struct Node {
+    long references = 0;
+    bool alive = false;
+    Scope *scope = nullptr;
+    const JSFunction *function = nullptr;
   };
-  auto function_declaration_inner = FunctionDeclaration {
-    Identifier { "inner" },
-    Block({
-      std::make_shared<ReturnStatement>(std::make_shared<CallExpression>(std::make_shared<Identifier>("getter"), args_getter))
-    }),
-    {
-      Parameter{ Identifier{ "getter" } }
+  std::map<const void *, Node> nodes;
+  
+  std::vector<std::shared_ptr<Scope>> scopes;
+  for (const auto &weak_scope : scopes_) {
+    if (auto scope = weak_scope.lock()) {
+      // Not counting the one just taken
+      nodes[scope.get()] = Node { scope.use_count() - 1, false, scope.get(), nullptr };
+      scopes.push_back(scope);
     }
-  };
-  // pair
-  auto function_declaration_pair = FunctionDeclaration {
-    Identifier { "pair" },
-    Block({
-      std::make_shared<FunctionDeclaration>(function_declaration_inner),
-      std::make_shared<ReturnStatement>(std::make_shared<Identifier>("inner"))
-    }),
-    {
-      Parameter{ Identifier{ "a" } },
-      Parameter{ Identifier{ "b" } }
+  }
+  for (const auto &scope : scopes) {
+    for (const auto &[name, value] : scope->values) {
+      if (value && value->type == JSType::Function && nodes.find(value.get()) == nodes.end()) {
+        if (auto function = dynamic_cast<const JSFunction *>(value.get())) {
+          nodes[value.get()] = Node { value.use_count(), false, nullptr, function };
+        }
+      }
     }
-  };
-  source_file.statements.push_back(std::make_shared<FunctionDeclaration>(function_declaration_pair));
+  }
   
-  // getFirst
-  auto function_declaration_getFirst = FunctionDeclaration {
-    Identifier { "getFirst" },
-    Block({
-      std::make_shared<ReturnStatement>(std::make_shared<Identifier>("a"))
-    }),
-    {
-      Parameter{ Identifier{ "a" } },
-      Parameter{ Identifier{ "b" } }
-    }
-  };
-  // first
-  std::vector<std::shared_ptr<Expression>> args_pair = {
-    std::make_shared<Identifier>("getFirst")
-  };
-  auto function_declaration_first = FunctionDeclaration {
-    Identifier { "first" },
-    Block({
-      std::make_shared<FunctionDeclaration>(function_declaration_getFirst),
-      std::make_shared<ReturnStatement>(std::make_shared<CallExpression>(std::make_shared<Identifier>("pair"), args_pair))
-    }),
-    {
-      Parameter{ Identifier{ "pair" } }
+  auto for_each_edge = [&](const Node &node, auto callback) {
+    if (node.scope) {
+      if (auto parent = nodes.find(node.scope->parent.get()); parent != nodes.end()) {
+        callback(parent->second);
+      }
+      for (const auto &[name, value] : node.scope->values) {
+        if (auto function = nodes.find(value.get()); function != nodes.end()) {
+          callback(function->second);
+        }
+      }
+    } else {
+      if (auto scope = nodes.find(node.function->local_chain_.scope.get()); scope != nodes.end()) {
+        callback(scope->second);
+      }
     }
   };
-  source_file.statements.push_back(std::make_shared<FunctionDeclaration>(function_declaration_first));
   
-  // getSecond
-  auto function_declaration_getSecond = FunctionDeclaration {
-    Identifier { "getSecond" },
-    Block({
-      std::make_shared<ReturnStatement>(std::make_shared<Identifier>("b"))
-    }),
-    {
-      Parameter{ Identifier{ "a" } },
-      Parameter{ Identifier{ "b" } }
+  for (auto &[pointer, node] : nodes) {
+    for_each_edge(node, [](Node &target) { --target.references; });
+  }
+  
+  std::vector<Node *> alive;
+  for (auto &[pointer, node] : nodes) {
+    if (node.references > 0) {
+      node.alive = true;
+      alive.push_back(&node);
     }
-  };
-  // second
-  std::vector<std::shared_ptr<Expression>> args_pair_2 = {
-    std::make_shared<Identifier>("getSecond")
-  };
-  auto function_declaration_second = FunctionDeclaration {
-    Identifier { "second" },
-    Block({
-      std::make_shared<FunctionDeclaration>(function_declaration_getSecond),
-      std::make_shared<ReturnStatement>(std::make_shared<CallExpression>(std::make_shared<Identifier>("pair"), args_pair_2))
-    }),
-    {
-      Parameter{ Identifier{ "pair" } }
+  }
+  while (!alive.empty()) {
+    auto node = alive.back();
+    alive.pop_back();
+    for_each_edge(*node, [&](Node &target) {
+      if (!target.alive) {
+        target.alive = true;
+        alive.push_back(&target);
+      }
+    });
+  }
+  
+  for (auto &[pointer, node] : nodes) {
+    if (node.scope && !node.alive) {
+      node.scope->values.clear();
+      node.scope->parent.reset();
     }
-  };
-  source_file.statements.push_back(std::make_shared<FunctionDeclaration>(function_declaration_second));
+  }
   
-  // sum
-  auto first_if_condition = BinaryExpression { std::make_shared<Identifier>("list"), Token::EqualsEqualsEquals, std::make_shared<Identifier>("undefined") };
-  auto first_if_block = Block({ std::make_shared<ReturnStatement>(std::make_shared<NumericLiteral>("0")) });
+  nodes.clear();
+  scopes.clear();
+  prune();
+  collecting_ = false;
+  return before - std::min(before, load(used_));
+}
+
+std::shared_ptr<JSValue> JSValue::get_property(const std::string name) const {
+  return Heap::make<JSUndefined>();
+}
+
+std::shared_ptr<JSValue> JSValue::construct(Chain &chain, std::vector<std::shared_ptr<JSValue>> values) const {
+  throw std::runtime_error("TypeError: " + serialize() + " is not a constructor");
+}
+
+class JSObject : public JSValue {
+public:
+  Properties properties { Properties::allocator_type(HeapCategory::Object) };
   
-  std::vector<std::shared_ptr<Expression>> left_args = {
-    std::make_shared<Identifier>("list")
-  };
-  auto left = std::make_shared<CallExpression>(std::make_shared<Identifier>("first"), left_args);
+  JSObject(JSType type = JSType::Object) : JSValue(type) {};
   
+  std::string serialize() const override { return "Object {}"; };
   
-  std::vector<std::shared_ptr<Expression>> right_inner_args = {
-    std::make_shared<Identifier>("list")
-  };
-  auto right_inner = std::make_shared<CallExpression>(std::make_shared<Identifier>("second"), left_args);
-  std::vector<std::shared_ptr<Expression>> right_args = {
-    right_inner
+  std::shared_ptr<JSValue>
+  plus_operator(std::shared_ptr<JSValue> right) const override {
+    return Heap::make<JSUndefined>();
   };
-  auto right = std::make_shared<CallExpression>(std::make_shared<Identifier>("sum"), right_args);
   
-  auto function_declaration_sum = FunctionDeclaration {
-    Identifier { "sum" },
-    Block({
-      std::make_shared<IfStatement>(first_if_condition, first_if_block),
-      std::make_shared<ReturnStatement>(std::make_shared<BinaryExpression>(left, Token::Plus, right))
-    }),
-    {
-      Parameter{ Identifier{ "list" } }
-    }
+  std::shared_ptr<JSValue>
+  minus_operator(std::shared_ptr<JSValue> right) const override {
+    return Heap::make<JSUndefined>();
   };
-  source_file.statements.push_back(std::make_shared<FunctionDeclaration>(function_declaration_sum));
   
-  // main
-  std::vector<std::shared_ptr<Expression>> pair_4_args = {
-    std::make_shared<NumericLiteral>("4"),
+  std::shared_ptr<JSBoolean>
+  equalsequalsequals_operator(std::shared_ptr<JSValue> right) const override {
+    return Heap::make<JSBoolean>(right.get() == this);
   };
   
-  std::vector<std::shared_ptr<Expression>> pair_3_args = {
-    std::make_shared<NumericLiteral>("3"),
-    std::make_shared<CallExpression>(std::make_shared<Identifier>("pair"), pair_4_args)
+  std::shared_ptr<JSBoolean>
+  lessthan_operator(std::shared_ptr<JSValue> right) const override {
+    return Heap::make<JSBoolean>(false);
   };
   
-  std::vector<std::shared_ptr<Expression>> pair_2_args = {
-    std::make_shared<NumericLiteral>("2"),
-    std::make_shared<CallExpression>(std::make_shared<Identifier>("pair"), pair_3_args)
-  };
+  std::shared_ptr<JSNumber> as_number() const override {
+    return Heap::make<JSNumber>(0);
+  }
   
-  std::vector<std::shared_ptr<Expression>> pair_1_args = {
-    std::make_shared<NumericLiteral>("1"),
-    std::make_shared<CallExpression>(std::make_shared<Identifier>("pair"), pair_2_args)
+  std::shared_ptr<JSBoolean> as_boolean() const override {
+    return Heap::make<JSBoolean>(true);
+  }
+  
+  std::shared_ptr<JSValue> call(Chain &chain, std::vector<std::shared_ptr<JSValue>> values) const override {
+    throw std::runtime_error(this->serialize() + " is not a function");
+  }
+  
+  std::shared_ptr<JSValue> get_property(const std::string name) const override {
+    auto it = properties.find(name);
+    if (it == properties.end()) {
+      return Heap::make<JSUndefined>();
+    }
+    return it->second;
+  }
+};
+
+using NativeFunction = std::function<std::shared_ptr<JSValue>(Chain &chain, std::vector<std::shared_ptr<JSValue>> values)>;
+
+// Arguments of a FastNativeFunction, read in place from the caller's values
+class NativeArguments {
+public:
+  NativeArguments(const std::vector<std::shared_ptr<JSValue>> &values) : values_(values) {};
+  
+  std::size_t size() const { return values_.size(); }
+  
+  const JSValue &operator[](std::size_t index) const {
+    static const JSUndefined undefined;
+    if (index < values_.size() && values_[index]) {
+      return *values_[index];
+    }
+    return undefined;
+  }
+  
+  double number(std::size_t index) const {
+    const auto &value = (*this)[index];
+    if (value.type == JSType::Number) {
+      return static_cast<const JSNumber &>(value).value;
+    }
+    return value.as_number()->value;
+  }
+  
+  bool boolean(std::size_t index) const {
+    const auto &value = (*this)[index];
+    if (value.type == JSType::Boolean) {
+      return static_cast<const JSBoolean &>(value).value;
+    }
+    return value.as_boolean()->value;
+  }
+  
+  std::string string(std::size_t index) const {
+    const auto &value = (*this)[index];
+    if (value.type == JSType::String) {
+      return static_cast<const JSString &>(value).value;
+    }
+    return value.serialize();
+  }
+  
+private:
+  const std::vector<std::shared_ptr<JSValue>> &values_;
+};
+
+// Host callback without the std::function and argument vector copies of
+// NativeFunction. `data` is passed through from registration.
+using FastNativeFunction = std::shared_ptr<JSValue> (*)(void *data, const NativeArguments &arguments);
+
+// Function implemented in C++, e.g. setTimeout. A native function is a
+// constructor if it has a constructor callback.
+class JSNativeFunction : public JSObject {
+public:
+  const std::string name;
+  const NativeFunction function;
+  const NativeFunction constructor;
+  
+  JSNativeFunction(const std::string name, const NativeFunction function, const NativeFunction constructor = nullptr)
+  : JSObject(JSType::Function), name(name), function(function), constructor(constructor) {};
+  
+  JSNativeFunction(const std::string name, FastNativeFunction fast_function, void *data)
+  : JSObject(JSType::Function), name(name), fast_function_(fast_function), data_(data) {};
+  
+  std::string serialize() const override { return "Function {}"; };
+  
+  std::shared_ptr<JSValue> call(Chain &chain, std::vector<std::shared_ptr<JSValue>> values) const override {
+    if (fast_function_) {
+      return fast_function_(data_, NativeArguments(values));
+    }
+    return function(chain, std::move(values));
+  }
+  
+  std::shared_ptr<JSValue> construct(Chain &chain, std::vector<std::shared_ptr<JSValue>> values) const override {
+    if (!constructor) {
+      return JSValue::construct(chain, values);
+    }
+    return constructor(chain, values);
+  }
+  
+private:
+  const FastNativeFunction fast_function_ = nullptr;
+  void *const data_ = nullptr;
+};
+
+std::shared_ptr<JSValue> argument_at(const std::vector<std::shared_ptr<JSValue>> &values, std::size_t index) {
+  if (index < values.size() && values[index]) {
+    return values[index];
+  }
+  return Heap::make<JSUndefined>();
+}
+
+class EventLoop;
+
+class JSPromise : public JSObject, public std::enable_shared_from_this<JSPromise> {
+public:
+  EventLoop &event_loop;
+  
+  JSPromise(EventLoop &event_loop) : event_loop(event_loop) {};
+  
+  std::string serialize() const override {
+    if (!value_) {
+      return "Promise { <pending> }";
+    }
+    return std::string("Promise { ") + (rejected_ ? "<rejected> " : "") + value_->serialize() + " }";
   };
-  std::vector<std::shared_ptr<Expression>> pair_1 = {std::make_shared<CallExpression>(std::make_shared<Identifier>("pair"), pair_1_args)};
   
-  auto call_expression_first = std::make_shared<CallExpression>(std::make_shared<Identifier>("sum"), pair_1);
+  std::shared_ptr<JSValue> get_property(const std::string name) const override;
   
-  auto function_declaration_main = FunctionDeclaration {
-    Identifier { "main" },
-    Block({ std::make_shared<ReturnStatement>(call_expression_first) }),
-    {}
+  // Fulfilled value, nullptr while pending or if rejected
+  std::shared_ptr<JSValue> value() const { return rejected_ ? nullptr : value_; }
+  
+  // Rejection reason, nullptr unless rejected
+  std::shared_ptr<JSValue> reason() const { return rejected_ ? value_ : nullptr; }
+  
+  // Resolving with another promise adopts its state.
+  void resolve(std::shared_ptr<JSValue> value);
+  
+  void reject(std::shared_ptr<JSValue> reason);
+  
+  // Returns the promise resolved with the result of the callback for the
+  // outcome. A callback that is not a function passes the outcome through.
+  std::shared_ptr<JSPromise> then(std::shared_ptr<JSValue> on_fulfilled, std::shared_ptr<JSValue> on_rejected);
+  
+private:
+  friend class EventLoop;
+  
+  struct Reaction {
+    std::shared_ptr<JSValue> on_fulfilled;
+    std::shared_ptr<JSValue> on_rejected;
+    std::shared_ptr<JSPromise> promise;
   };
-  source_file.statements.push_back(std::make_shared<FunctionDeclaration>(function_declaration_main));
   
-  return source_file;
+  bool resolved_ = false;
+  bool rejected_ = false;
+  // Fulfilled value or rejection reason, nullptr while pending
+  std::shared_ptr<JSValue> value_;
+  // Most promises get a single reaction, keep it inline
+  Reaction first_reaction_;
+  std::vector<Reaction> more_reactions_;
+  
+  // Bound methods, made on first access. They live inside the promise, see
+  // get_property.
+  mutable std::optional<JSNativeFunction> then_;
+  mutable std::optional<JSNativeFunction> catch_;
+  
+  void add_reaction(Reaction reaction);
+  void enqueue(const Reaction &reaction);
+  void settle(std::shared_ptr<JSValue> value, bool rejected);
+};
+
+// FunctionDeclaration
+std::shared_ptr<JSValue> FunctionDeclaration::evaluate(Chain &chain) const {
+  TRACE_LOG("FunctionDeclaration::evaluate", name.text);
+  auto function_value = Heap::make<JSFunction>(shared_from_this(), chain.captured());
+  TRACE_EVENT(TraceKind::Allocation, Trace::function_name(), sizeof(JSFunction));
+  chain.set_value(name.text, function_value);
+  return nullptr;
+}
+// Calls after which a function tiers up, see CompileQueue
+const int kHotFunctionThreshold = 10;
+
+std::shared_ptr<JSValue> FunctionDeclaration::execute(Chain &chain) const {
+  TRACE_LOG("FunctionDeclaration::execute", name.text);
+  // A heuristic, a call lost between threads doesn't matter
+  auto calls = body_->calls.load(std::memory_order_relaxed) + 1;
+  body_->calls.store(calls, std::memory_order_relaxed);
+  if (calls == kHotFunctionThreshold) {
+    TRACE_LOG("FunctionDeclaration::execute, tier up", name.text);
+    body().tier_up();
+  }
+  return body().evaluate(chain);
 }
+StatementKind FunctionDeclaration::getKind() const { return kind; }
 
-std::shared_ptr<JSValue> createScopeAndEvaluate(SourceFile source_file) {
-  auto globalScope = Scope {};
-  auto chain = Chain {};
+std::string FunctionDeclaration::serialize() const {
+  std::string result = (is_generator ? "function* " : "function ") + name.text + "(";
   
-  chain.scopes.push_back(globalScope);
+  for (const auto& parameter: parameters) {
+    result += parameter.name.text + ", ";
+  }
+  result += ") {\n";
   
-  chain.load(source_file);
+  result += body().serialize("  ");
   
-  auto main_function = chain.lookup_value("main");
-  if (!main_function) {
-    log("No main function!");
+  return result + "}";
+}
+
+// Global variables
+//
+// Top-level functions and variables live in the bottom scope of the chain.
+// A name that no enclosing function declares is resolved to a global once,
+// when its function is analyzed, and is then read through a cell: a pointer
+// to the variable's entry in the global scope, found on the first read in
+// each context. Reassigning a global stores into the same entry, so the
+// cells stay valid until the global scope is cleared with its Context.
+class GlobalNames {
+public:
+  // Process-wide, like the AST that keeps the ids
+  static uint32_t intern(const std::string &name) {
+    static std::mutex mutex;
+    static std::map<std::string, uint32_t> ids;
+    std::lock_guard<std::mutex> lock(mutex);
+    return ids.insert({name, static_cast<uint32_t>(ids.size())}).first->second;
+  }
+};
+
+std::shared_ptr<JSValue> *Scope::cell(uint32_t id, const std::string &name) {
+  if (id < cells.size() && cells[id]) {
+    return cells[id];
+  }
+  auto it = values.find(name);
+  if (it == values.end()) {
     return nullptr;
   }
-  
-  return main_function->call(chain, {});
+  if (cells.size() <= id) {
+    cells.resize(id + 1);
+  }
+  return cells[id] = &it->second;
 }
 
-int main(int argc, const char *argv[]) {
-  {
-    auto source_file = createFibonacciProgram();
-    auto value = createScopeAndEvaluate(source_file);
-    if (!value) {
-      return 1;
-    }
-    auto serialized_value = value->serialize();
-    std::cout << source_file.fileName << ": " << serialized_value << std::endl;
-    assert(serialized_value == "75025.000000");
+void Identifier::resolve_global() const {
+  if (global_name_.load(std::memory_order_relaxed) == kNotGlobal) {
+    global_name_.store(GlobalNames::intern(text), std::memory_order_relaxed);
   }
-  
-  {
-    auto source_file = createLetProgram();
-    auto value = createScopeAndEvaluate(source_file);
+}
+
+void Identifier::visit() const { printf("Visit Identifier\n"); }
+std::shared_ptr<JSValue> Identifier::evaluate(Chain &chain) const {
+  auto global_name = global_name_.load(std::memory_order_relaxed);
+  if (global_name != kNotGlobal) {
+    if (auto cell = chain.global ? chain.global->cell(global_name, text) : nullptr) {
+      TRACE_LOG("Identifier::evaluate", text, "=", (*cell)->serialize());
+      TRACE_EVENT(TraceKind::Lookup, trace_name(), static_cast<uint64_t>(TraceLookup::Global));
+      return *cell;
+    }
+  } else if (find_in_frame(chain)) {
+    auto value = chain.frame->slot(frame_slot_.load(std::memory_order_relaxed));
     if (!value) {
-      return 1;
+      value = Heap::make<JSUndefined>();
     }
-    auto serialized_value = value->serialize();
-    std::cout << source_file.fileName << ": " << serialized_value << std::endl;
-    assert(serialized_value == "3.000000");
+    TRACE_LOG("Identifier::evaluate", text, "=", value->serialize());
+    TRACE_EVENT(TraceKind::Lookup, trace_name(), static_cast<uint64_t>(TraceLookup::Frame));
+    return value;
   }
   
-  {
-    auto source_file = createClosureProgram();
-    auto value = createScopeAndEvaluate(source_file);
-    if (!value) {
-      return 1;
+  auto value = chain.lookup_value(text);
+  TRACE_EVENT(TraceKind::Lookup, trace_name(), static_cast<uint64_t>(TraceLookup::Chain));
+  TRACE_LOG("Identifier::evaluate", text, "=", value->serialize());
+  return value;
+}
+
+void Identifier::assign(Chain &chain, std::shared_ptr<JSValue> value) const {
+  auto global_name = global_name_.load(std::memory_order_relaxed);
+  if (global_name != kNotGlobal) {
+    if (auto cell = chain.global ? chain.global->cell(global_name, text) : nullptr) {
+      *cell = value;
+      return;
     }
-    auto serialized_value = value->serialize();
-    std::cout << source_file.fileName << ": " << serialized_value << std::endl;
-    assert(serialized_value == "42.000000");
+  } else if (find_in_frame(chain)) {
+    chain.frame->slot(frame_slot_.load(std::memory_order_relaxed)) = value;
+    return;
   }
-  
-  {
-    auto source_file = createListProgram();
+  chain.assign_value(text, value);
+}
+
+bool Identifier::find_in_frame(Chain &chain) const {
+  if (!chain.frame) {
+    return false;
+  }
+  if (&chain.frame->names == frame_names_.load(std::memory_order_acquire)) {
+    return true;
+  }
+  
+  auto index = chain.frame->find(text);
+  if (index == -1) {
+    return false;
+  }
+  frame_slot_.store(index, std::memory_order_relaxed);
+  frame_names_.store(&chain.frame->names, std::memory_order_release);
+  return true;
+}
+
+std::string Identifier::serialize() const {
+  return text;
+}
+
+// Feedback
+//
+// What a node learned from running, e.g. the operand types of a
+// BinaryExpression, kept per Context: the AST is shared between contexts
+// (see ProgramCache), and one context's types shouldn't deoptimize another.
+// Nodes that collect feedback get a process-wide slot, like the ids of
+// GlobalNames, and look their state up in the table of the running context.
+// Slots aren't reused, a table grows to the highest slot its context ran,
+// one byte each, charged to the context's heap. A context runs on one
+// thread at a time, so the table needs no synchronization.
+class Feedback {
+public:
+  Feedback(Heap *heap = nullptr) : states_(States::allocator_type(heap, HeapCategory::Feedback)) {};
+  Feedback(const Feedback &) = delete;
+  
+  static uint32_t allocate_slot() {
+    static std::atomic<uint32_t> next {0};
+    return next.fetch_add(1, std::memory_order_relaxed);
+  }
+  
+  // Zero until the node sets it
+  uint8_t get(uint32_t slot) const {
+    return slot < states_.size() ? states_[slot] : 0;
+  }
+  
+  void set(uint32_t slot, uint8_t state) {
+    if (slot >= states_.size()) {
+      states_.resize(std::max<std::size_t>(slot + 1, states_.size() * 2));
+    }
+    states_[slot] = state;
+  }
+  
+private:
+  using States = std::vector<uint8_t, HeapAllocator<uint8_t>>;
+  
+  States states_;
+};
+
+class TrueKeyword : public Expression {
+public:
+  void visit() const override { printf("Visit TrueKeyword\n"); }
+  
+  std::shared_ptr<JSValue> evaluate(Chain &chain) const override {
+    return JSBoolean::from(true);
+  }
+  
+  std::string serialize() const override {
+    return "true";
+  }
+};
+
+class FalseKeyword : public Expression {
+public:
+  void visit() const override { printf("Visit FalseKeyword\n"); }
+  
+  std::shared_ptr<JSValue> evaluate(Chain &chain) const override {
+    return JSBoolean::from(false);
+  }
+  
+  std::string serialize() const override {
+    return "false";
+  }
+};
+
+class NumericLiteral : public Expression {
+public:
+  const std::string text;
+  
+  NumericLiteral(const std::string text) : text(text), value_(std::make_shared<JSNumber>(std::stod(text))){};
+  
+  void visit() const override { printf("Visit NumericLiteral\n"); }
+  
+  std::shared_ptr<JSValue> evaluate(Chain &chain) const override {
+    return value_;
+  }
+  
+  std::string serialize() const override {
+    return text;
+  }
+  
+private:
+  // Parsed once; numbers are immutable, so every evaluation returns the same one
+  const std::shared_ptr<JSNumber> value_;
+};
+
+class StringLiteral : public Expression {
+public:
+  const std::string text;
+  
+  StringLiteral(const std::string text) : text(text), value_(std::make_shared<JSString>(text)){};
+  
+  void visit() const override { printf("Visit StringLiteral\n"); }
+  
+  std::shared_ptr<JSValue> evaluate(Chain &chain) const override {
+    return value_;
+  }
+  
+  std::string serialize() const override {
+    return "\"" + text + "\"";
+  }
+  
+private:
+  const std::shared_ptr<JSString> value_;
+};
+
+class BinaryExpression : public Expression {
+public:
+  const std::shared_ptr<Expression> left;
+  const std::shared_ptr<Expression> right;
+  const Token operatorToken;
+  
+  BinaryExpression(const std::shared_ptr<Expression> left, const Token operatorToken,
+                   const std::shared_ptr<Expression> right)
+  : left(left), right(right), operatorToken(operatorToken) {};
+  
+  // A copy starts over without feedback
+  BinaryExpression(const BinaryExpression &other)
+  : left(other.left), right(other.right), operatorToken(other.operatorToken) {};
+  
+  void visit() const override {
+    printf("Visit BinaryExpression\n");
+    left->visit();
+    right->visit();
+  }
+  
+  std::shared_ptr<JSValue> evaluate(Chain &chain) const override {
+    TRACE_LOG("BinaryExpression::evaluate");
+    auto specialization = chain.feedback ? static_cast<Specialization>(chain.feedback->get(feedback_slot_))
+      : Specialization::Uninitialized;
+    switch (specialization) {
+      case Specialization::Uninitialized:
+        return evaluate_uninitialized(chain);
+      case Specialization::Assignment:
+        return evaluate_assignment(chain);
+      case Specialization::Numbers:
+        switch (operatorToken) {
+          case Token::Plus: return evaluate_numbers<Token::Plus>(chain);
+          case Token::Minus: return evaluate_numbers<Token::Minus>(chain);
+          case Token::EqualsEqualsEquals: return evaluate_numbers<Token::EqualsEqualsEquals>(chain);
+          case Token::LessThan: return evaluate_numbers<Token::LessThan>(chain);
+          case Token::Equals: break;
+        }
+        break;
+      case Specialization::Generic:
+        break;
+    }
+    return evaluate_generic(chain);
+  }
+  
+  std::string serialize() const override {
+    std::string result = left->serialize();
+    
+    switch (operatorToken) {
+      case Token::Plus: result += " + "; break;
+      case Token::Minus: result += " - "; break;
+      case Token::EqualsEqualsEquals: result += " === "; break;
+      case Token::LessThan: result += " < "; break;
+      case Token::Equals: result += " = "; break;
+    }
+    
+    return result + right->serialize();
+  }
+  
+private:
+  // The node rewrites itself after running: it specializes on the operand
+  // types it saw, and goes generic for good once a guard fails. The state is
+  // per Context, see Feedback.
+  enum class Specialization : uint8_t {
+    Uninitialized,
+    Assignment,
+    Numbers,
+    Generic,
+  };
+  const uint32_t feedback_slot_ = Feedback::allocate_slot();
+  
+  void specialize(Chain &chain, Specialization specialization) const {
+    if (chain.feedback) {
+      chain.feedback->set(feedback_slot_, static_cast<uint8_t>(specialization));
+    }
+  }
+  
+  std::shared_ptr<JSValue> evaluate_uninitialized(Chain &chain) const {
+    if (operatorToken == Token::Equals) {
+      if (!std::dynamic_pointer_cast<Identifier>(left)) {
+        throw std::runtime_error("SyntaxError: invalid assignment target " + left->serialize());
+      }
+      specialize(chain, Specialization::Assignment);
+      return evaluate_assignment(chain);
+    }
+    
+    auto left_value = left->evaluate(chain);
+    auto right_value = right->evaluate(chain);
+    
+    if (left_value->type != JSType::Number || right_value->type != JSType::Number) {
+      specialize(chain, Specialization::Generic);
+    } else {
+      specialize(chain, Specialization::Numbers);
+    }
+    
+    return apply(left_value, right_value);
+  }
+  
+  template <Token token>
+  std::shared_ptr<JSValue> evaluate_numbers(Chain &chain) const {
+    auto left_value = left->evaluate(chain);
+    auto right_value = right->evaluate(chain);
+    
+    if (left_value->type != JSType::Number || right_value->type != JSType::Number) {
+      TRACE_LOG("BinaryExpression::evaluate_numbers, guard failed");
+      specialize(chain, Specialization::Generic);
+      return apply(left_value, right_value);
+    }
+    
+    auto l = static_cast<const JSNumber &>(*left_value).value;
+    auto r = static_cast<const JSNumber &>(*right_value).value;
+    
+    if constexpr (token == Token::Plus) {
+      return Heap::make<JSNumber>(l + r);
+    } else if constexpr (token == Token::Minus) {
+      return Heap::make<JSNumber>(l - r);
+    } else if constexpr (token == Token::EqualsEqualsEquals) {
+      // Same comparison as JSNumber::equalsequalsequals_operator
+      return JSBoolean::from(fabs(l - r) < 0.0001f);
+    } else {
+      return JSBoolean::from(l < r);
+    }
+  }
+  
+  std::shared_ptr<JSValue> evaluate_assignment(Chain &chain) const {
+    auto right_value = right->evaluate(chain);
+    static_cast<const Identifier &>(*left).assign(chain, right_value);
+    return right_value;
+  }
+  
+  std::shared_ptr<JSValue> evaluate_generic(Chain &chain) const {
+    auto left_value = left->evaluate(chain);
+    auto right_value = right->evaluate(chain);
+    return apply(left_value, right_value);
+  }
+  
+  std::shared_ptr<JSValue> apply(const std::shared_ptr<JSValue> &left_value, std::shared_ptr<JSValue> right_value) const {
+    switch (operatorToken) {
+      case Token::Plus:
+        return left_value->plus_operator(std::move(right_value));
+      case Token::Minus:
+        return left_value->minus_operator(std::move(right_value));
+      case Token::EqualsEqualsEquals:
+        return left_value->equalsequalsequals_operator(std::move(right_value));
+      case Token::LessThan:
+        return left_value->lessthan_operator(std::move(right_value));
+      case Token::Equals:
+        break;
+    }
+    throw std::logic_error("BinaryExpression::apply, unexpected operator");
+  }
+};
+
+class ConditionalExpression : public Expression {
+public:
+  const std::shared_ptr<Expression> condition;
+  const std::shared_ptr<Expression> whenTrue;
+  const std::shared_ptr<Expression> whenFalse;
+  
+  ConditionalExpression(const std::shared_ptr<Expression> condition, const std::shared_ptr<Expression> whenTrue,
+                        const std::shared_ptr<Expression> whenFalse)
+  : condition(condition), whenTrue(whenTrue), whenFalse(whenFalse){};
+  
+  void visit() const override { printf("Visit ConditionalExpression\n"); }
+  
+  std::shared_ptr<JSValue> evaluate(Chain &chain) const override {
+    TRACE_LOG("ConditionalExpression::evaluate");
+    bool result = is_truthy(condition->evaluate(chain));
+    
+    if (result) {
+      return whenTrue->evaluate(chain);
+    } else {
+      return whenFalse->evaluate(chain);
+    }
+  }
+  
+  std::string serialize() const override {
+    return "ConditionalExpression";
+  }
+};
+
+class CallExpression : public Expression {
+public:
+  const std::shared_ptr<Expression> expression;
+  const std::vector<std::shared_ptr<Expression>> arguments;
+  
+  CallExpression(const std::shared_ptr<Expression> expression,
+                 const std::vector<std::shared_ptr<Expression>> arguments)
+  : expression(expression), arguments(arguments){};
+  
+  void visit() const override { printf("Visit CallExpression\n"); }
+  
+  std::shared_ptr<JSValue> evaluate(Chain &chain) const override {
+    auto value = expression->evaluate(chain);
+    
+    TRACE_LOG("CallExpression::evaluate, got value", value->serialize());
+    
+    auto state = chain.feedback ? static_cast<State>(chain.feedback->get(feedback_slot_)) : State::Generic;
+    if (state == State::Inlined) {
+      if (typeid(*value) == typeid(JSFunction) &&
+          static_cast<const JSFunction &>(*value).declaration == inline_target_) {
+        return evaluate_inlined(chain, static_cast<const JSFunction &>(*value));
+      }
+      TRACE_LOG("CallExpression::evaluate, deoptimized", serialize());
+      chain.feedback->set(feedback_slot_, static_cast<uint8_t>(State::Generic));
+    }
+    
+    std::vector<std::shared_ptr<JSValue>> values{};
+    values.reserve(arguments.size());
+    
+    for (const auto& argument : arguments) {
+      values.push_back(argument->evaluate(chain));
+    }
+    
+    TRACE_LOG("CallExpression::evaluate,", values.size(), "argument(s)");
+    
+    auto result = value->call(chain, std::move(values));
+    if (state == State::Uninitialized) {
+      record_target(chain, *value);
+    }
+    return result;
+  }
+  
+  std::string serialize() const override {
+    std::string result = expression->serialize() + "(";
+    
+    for (const auto& argument : arguments) {
+      result += argument->serialize() + ", ";
+    }
+    
+    return result + ")";
+  }
+  
+private:
+  // Call-site feedback, per Context (see Feedback). The first callee is
+  // recorded; if it's the small leaf function (see inline_expression) whose
+  // code the call site inlines, its body runs in place of the call, guarded
+  // by the identity of the callee's code. A different callee deoptimizes the
+  // call site back to real calls for good.
+  enum class State : uint8_t {
+    Uninitialized,
+    Inlined,
+    Generic,
+  };
+  const uint32_t feedback_slot_ = Feedback::allocate_slot();
+  
+  // The inlined code is shared like the rest of the AST: the first leaf
+  // callee any context records is written once, then published
+  enum class Target : uint8_t {
+    None,
+    Writing,
+    Written,
+  };
+  mutable std::atomic<Target> target_ {Target::None};
+  mutable std::shared_ptr<const FunctionDeclaration> inline_target_;
+  mutable const Expression *inline_expression_ = nullptr;
+  
+  void record_target(Chain &chain, const JSValue &callee) const;
+  std::shared_ptr<JSValue> evaluate_inlined(Chain &chain, const JSFunction &function) const;
+};
+
+class PropertyAccessExpression : public Expression {
+public:
+  const std::shared_ptr<Expression> expression;
+  const Identifier name;
+  
+  PropertyAccessExpression(const std::shared_ptr<Expression> expression, const Identifier name)
+  : expression(expression), name(name){};
+  
+  void visit() const override { printf("Visit PropertyAccessExpression\n"); }
+  
+  std::shared_ptr<JSValue> evaluate(Chain &chain) const override {
+    TRACE_LOG("PropertyAccessExpression::evaluate", name.text);
+    return expression->evaluate(chain)->get_property(name.text);
+  }
+  
+  std::string serialize() const override {
+    return expression->serialize() + "." + name.text;
+  }
+};
+
+class NewExpression : public Expression {
+public:
+  const std::shared_ptr<Expression> expression;
+  const std::vector<std::shared_ptr<Expression>> arguments;
+  
+  NewExpression(const std::shared_ptr<Expression> expression,
+                const std::vector<std::shared_ptr<Expression>> arguments)
+  : expression(expression), arguments(arguments){};
+  
+  void visit() const override { printf("Visit NewExpression\n"); }
+  
+  std::shared_ptr<JSValue> evaluate(Chain &chain) const override {
+    std::vector<std::shared_ptr<JSValue>> values{};
+    
+    for (const auto& argument : arguments) {
+      values.push_back(argument->evaluate(chain));
+    }
+    
+    TRACE_LOG("NewExpression::evaluate,", values.size(), "argument(s)");
+    
+    return expression->evaluate(chain)->construct(chain, values);
+  }
+  
+  std::string serialize() const override {
+    std::string result = "new " + expression->serialize() + "(";
+    
+    for (const auto& argument : arguments) {
+      result += argument->serialize() + ", ";
+    }
+    
+    return result + ")";
+  }
+};
+
+// Only valid where a generator can suspend, see GeneratorCode. The parser
+// doesn't allow it anywhere else.
+class YieldExpression : public Expression {
+public:
+  const std::shared_ptr<Expression> expression;
+  
+  YieldExpression(const std::shared_ptr<Expression> expression) : expression(expression) {};
+  
+  void visit() const override { printf("Visit YieldExpression\n"); }
+  
+  std::shared_ptr<JSValue> evaluate(Chain &chain) const override {
+    throw std::runtime_error("SyntaxError: Unsupported yield expression");
+  }
+  
+  std::string serialize() const override {
+    return "yield " + expression->serialize();
+  }
+};
+
+class IfStatement : public Statement {
+public:
+  const StatementKind kind;
+  const Block thenStatement;
+  const std::shared_ptr<Expression> expression;
+  
+  IfStatement(const std::shared_ptr<Expression> expression, const Block thenStatement)
+  : kind(StatementKind::If), thenStatement(thenStatement),
+  expression(expression){};
+  
+  IfStatement(const BinaryExpression expression, const Block thenStatement)
+  : IfStatement(std::make_shared<BinaryExpression>(expression), thenStatement) {};
+  
+  std::shared_ptr<JSValue> evaluate(Chain &chain) const override {
+    auto value = expression->evaluate(chain);
+    
+    if (is_truthy(value)) {
+      return thenStatement.evaluate(chain);
+    }
+    
+    return nullptr;
+  }
+  
+  StatementKind getKind() const override { return kind; }
+  
+  void tier_up() const override {
+    thenStatement.tier_up();
+  }
+  
+  std::string serialize() const override {
+    return "if (" + expression->serialize() + ") {\n" + thenStatement.serialize("  ") + "}";
+  }
+};
+
+std::shared_ptr<JSValue> Block::evaluate(Chain &chain) const {
+  for (const auto &statement : statements) {
+    auto value = statement->evaluate(chain);
+    if (value) {
+      return value;
+    }
+  }
+  return nullptr;
+}
+
+void Block::tier_up() const {
+  for (const auto &statement : statements) {
+    statement->tier_up();
+  }
+}
+
+std::string Block::serialize(const std::string offset) const {
+  std::string result = "";
+  
+  for (const auto& statement: statements) {
+    result += offset + statement->serialize() + ";\n";
+  }
+  
+  return result;
+};
+
+class ReturnStatement : public Statement {
+public:
+  const StatementKind kind;
+  const std::shared_ptr<Expression> expression;
+  
+  ReturnStatement(const std::shared_ptr<Expression> expression)
+  : kind(StatementKind::Return), expression(expression){};
+  
+  std::shared_ptr<JSValue> evaluate(Chain &chain) const override {
+    TRACE_LOG("ReturnStatement::evaluate");
+    return expression->evaluate(chain);
+  }
+  
+  StatementKind getKind() const override { return kind; }
+  
+  std::string serialize() const override {
+    return "return " + expression->serialize();
+  }
+};
+
+struct VariableDeclaration {
+  const Identifier name;
+  const std::shared_ptr<Expression> initializer;
+};
+
+struct VariableDeclarationList {
+  const std::vector<VariableDeclaration> declarations;
+};
+
+class VariableStatement : public Statement {
+public:
+  const StatementKind kind_;
+  const VariableDeclarationList declarationList_;
+  
+  VariableStatement(const VariableDeclarationList declarationList)
+  : kind_(StatementKind::VariableStatement), declarationList_(declarationList) {};
+  
+  std::shared_ptr<JSValue> evaluate(Chain &chain) const override {
+    TRACE_LOG("ReturnStatement::evaluate");
+    
+    for (const auto& declaration: declarationList_.declarations) {
+      chain.set_value(declaration.name.text, declaration.initializer->evaluate(chain));
+    }
+    
+    return nullptr;
+  }
+  
+  StatementKind getKind() const override { return kind_; }
+  
+  std::string serialize() const override {
+    return "VariableStatement";
+  }
+};
+
+class ExpressionStatement : public Statement {
+public:
+  const StatementKind kind;
+  const std::shared_ptr<Expression> expression;
+  
+  ExpressionStatement(const std::shared_ptr<Expression> expression)
+  : kind(StatementKind::Expression), expression(expression){};
+  
+  std::shared_ptr<JSValue> evaluate(Chain &chain) const override {
+    TRACE_LOG("ExpressionStatement::evaluate");
+    expression->evaluate(chain);
+    return nullptr;
+  }
+  
+  StatementKind getKind() const override { return kind; }
+  
+  std::string serialize() const override {
+    return expression->serialize();
+  }
+};
+
+class CompiledLoop;
+
+// Inlining
+//
+// A function is inlined at a call site if its body is a single return of an
+// expression that makes no calls and creates no closures, and its scope
+// isn't captured. The inlined body runs in a Frame of the caller's stack,
+// without an argument vector or a call through JSFunction::call. Being a
+// leaf it can't recurse, so there is no safepoint either.
+bool is_leaf_expression(const Expression &expression) {
+  if (dynamic_cast<const Identifier *>(&expression) || dynamic_cast<const NumericLiteral *>(&expression) ||
+      dynamic_cast<const StringLiteral *>(&expression) || dynamic_cast<const TrueKeyword *>(&expression) ||
+      dynamic_cast<const FalseKeyword *>(&expression)) {
+    return true;
+  }
+  if (auto binary = dynamic_cast<const BinaryExpression *>(&expression)) {
+    return is_leaf_expression(*binary->left) && is_leaf_expression(*binary->right);
+  }
+  if (auto conditional = dynamic_cast<const ConditionalExpression *>(&expression)) {
+    return is_leaf_expression(*conditional->condition) && is_leaf_expression(*conditional->whenTrue) &&
+      is_leaf_expression(*conditional->whenFalse);
+  }
+  if (auto property = dynamic_cast<const PropertyAccessExpression *>(&expression)) {
+    return is_leaf_expression(*property->expression);
+  }
+  return false;
+}
+
+// The expression to inline in place of a call, or null
+const Expression *inline_expression(const FunctionDeclaration &declaration) {
+  const auto &statements = declaration.body().statements;
+  if (declaration.is_generator || statements.size() != 1 || statements[0]->getKind() != StatementKind::Return ||
+      declaration.is_scope_captured()) {
+    return nullptr;
+  }
+  
+  const auto &expression = static_cast<const ReturnStatement &>(*statements[0]).expression;
+  if (!expression || !is_leaf_expression(*expression)) {
+    return nullptr;
+  }
+  return expression.get();
+}
+
+void CallExpression::record_target(Chain &chain, const JSValue &callee) const {
+  auto state = State::Generic;
+  if (typeid(callee) == typeid(JSFunction)) {
+    const auto &function = static_cast<const JSFunction &>(callee);
+    auto target = target_.load(std::memory_order_acquire);
+    if (target == Target::None && inline_expression(*function.declaration) &&
+        target_.compare_exchange_strong(target, Target::Writing, std::memory_order_relaxed)) {
+      inline_target_ = function.declaration;
+      inline_expression_ = inline_expression(*function.declaration);
+      target_.store(Target::Written, std::memory_order_release);
+      target = Target::Written;
+    }
+    if (target == Target::Writing) {
+      // Another thread is recording it, try again on the next call
+      return;
+    }
+    if (target == Target::Written && inline_target_ == function.declaration) {
+      TRACE_LOG("CallExpression::record_target, inlining", function.declaration->name.text);
+      state = State::Inlined;
+    }
+  }
+  chain.feedback->set(feedback_slot_, static_cast<uint8_t>(state));
+}
+
+std::shared_ptr<JSValue> CallExpression::evaluate_inlined(Chain &chain, const JSFunction &function) const {
+  const auto &parameters = function.declaration->parameters;
+  
+  Frame frame(function.declaration->locals());
+  for (std::size_t i = 0; i != arguments.size(); ++i) {
+    auto value = arguments[i]->evaluate(chain);
+    if (i < parameters.size()) {
+      frame.slot(i) = value;
+    }
+  }
+  
+  // A leaf creates no closures, so the chain can't outlive the call and
+  // doesn't need to own its scopes
+  Chain inline_chain;
+  inline_chain.scope = std::shared_ptr<Scope>(std::shared_ptr<Scope>(), function.local_chain_.scope.get());
+  inline_chain.builtins = std::shared_ptr<const Scope>(std::shared_ptr<const Scope>(), function.local_chain_.builtins.get());
+  inline_chain.global = function.local_chain_.global;
+  inline_chain.feedback = chain.feedback;
+  inline_chain.frame = &frame;
+  auto value = inline_expression_->evaluate(inline_chain);
+  if (!value) {
+    return Heap::make<JSUndefined>();
+  }
+  return value;
+}
+
+// Compile queue
+//
+// Compilation runs on background threads while the script keeps running in
+// the interpreter. A job works on its own snapshot of the AST, which is
+// immutable apart from the interpreter's caches the compiler doesn't read,
+// and the interpreter picks the result up at a safepoint.
+const std::size_t kCompileThreads = 2;
+
+class CompileQueue {
+public:
+  using Job = std::function<void()>;
+  
+  // Shared by all contexts, the threads start on first use
+  static CompileQueue &shared() {
+    static CompileQueue queue;
+    return queue;
+  }
+  
+  CompileQueue(const CompileQueue &) = delete;
+  
+  ~CompileQueue() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stopping_ = true;
+    }
+    work_.notify_all();
+    for (auto &thread : threads_) {
+      thread.join();
+    }
+  }
+  
+  void enqueue(Job job) {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      jobs_.push_back(std::move(job));
+      ++pending_;
+    }
+    work_.notify_one();
+  }
+  
+  // Blocks until every job enqueued so far has finished
+  void wait_idle() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    idle_.wait(lock, [this] { return pending_ == 0; });
+  }
+  
+  std::size_t completed() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return completed_;
+  }
+  
+private:
+  std::mutex mutex_;
+  std::condition_variable work_;
+  std::condition_variable idle_;
+  std::deque<Job> jobs_;
+  std::size_t pending_ = 0;
+  std::size_t completed_ = 0;
+  bool stopping_ = false;
+  std::vector<std::thread> threads_;
+  
+  CompileQueue() {
+    for (std::size_t i = 0; i != kCompileThreads; ++i) {
+      threads_.emplace_back([this] { work(); });
+    }
+  }
+  
+  void work() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (true) {
+      work_.wait(lock, [this] { return stopping_ || !jobs_.empty(); });
+      if (stopping_) {
+        return;
+      }
+      
+      auto job = std::move(jobs_.front());
+      jobs_.pop_front();
+      lock.unlock();
+      job();
+      lock.lock();
+      
+      ++completed_;
+      if (--pending_ == 0) {
+        idle_.notify_all();
+      }
+    }
+  }
+};
+
+// Loops count their back-edges. Once a loop is hot it's compiled in the
+// background and, when the code is ready, the running iteration moves into
+// it at a back-edge (on-stack replacement), see LoopCompiler below. The loops
+// of a hot function are compiled before they get hot themselves, see
+// FunctionDeclaration::execute.
+const int kOsrThreshold = 1000;
+
+class LoopProfile {
+public:
+  // Called on every back-edge. Returns true if the rest of the loop was run by compiled code.
+  bool back_edge(Chain &chain, const std::shared_ptr<Expression> &condition,
+                 const std::shared_ptr<Expression> &incrementor, const Block &statement);
+  
+  // Enqueues compiling the loop unless it's already compiled or queued
+  void request_compile(const std::shared_ptr<Expression> &condition,
+                       const std::shared_ptr<Expression> &incrementor, const Block &statement);
+  
+private:
+  enum class State : uint8_t {
+    Interpreted,
+    Queued,
+    Compiled,
+    Failed,
+  };
+  
+  // Shared with the compile thread, the code is written before the state
+  // turns Compiled
+  struct Code {
+    std::atomic<State> state {State::Interpreted};
+    std::shared_ptr<CompiledLoop> compiled;
+  };
+  
+  // The loop may run on several threads at once (see ProgramCache). The
+  // counters are only a heuristic, so updates may get lost.
+  std::atomic<int> back_edges_ {0};
+  // Back-edge at which to try entering the compiled code (again)
+  std::atomic<int> next_entry_ {0};
+  const std::shared_ptr<Code> code_ = std::make_shared<Code>();
+};
+
+class WhileStatement : public Statement {
+public:
+  const StatementKind kind;
+  const std::shared_ptr<Expression> expression;
+  const Block statement;
+  
+  WhileStatement(const std::shared_ptr<Expression> expression, const Block statement)
+  : kind(StatementKind::While), expression(expression), statement(statement){};
+  
+  std::shared_ptr<JSValue> evaluate(Chain &chain) const override {
+    TRACE_LOG("WhileStatement::evaluate");
+    while (is_truthy(expression->evaluate(chain))) {
+      auto value = statement.evaluate(chain);
+      if (value) {
+        return value;
+      }
+      Execution::safepoint();
+      if (profile_.back_edge(chain, expression, nullptr, statement)) {
+        break;
+      }
+    }
+    return nullptr;
+  }
+  
+  StatementKind getKind() const override { return kind; }
+  
+  void tier_up() const override {
+    profile_.request_compile(expression, nullptr, statement);
+    statement.tier_up();
+  }
+  
+  std::string serialize() const override {
+    return "while (" + expression->serialize() + ") {\n" + statement.serialize("  ") + "}";
+  }
+  
+private:
+  mutable LoopProfile profile_;
+};
+
+class ForStatement : public Statement {
+public:
+  const StatementKind kind;
+  const std::shared_ptr<Statement> initializer;
+  const std::shared_ptr<Expression> condition;
+  const std::shared_ptr<Expression> incrementor;
+  const Block statement;
+  
+  ForStatement(const std::shared_ptr<Statement> initializer, const std::shared_ptr<Expression> condition,
+               const std::shared_ptr<Expression> incrementor, const Block statement)
+  : kind(StatementKind::For), initializer(initializer), condition(condition),
+  incrementor(incrementor), statement(statement){};
+  
+  std::shared_ptr<JSValue> evaluate(Chain &chain) const override {
+    TRACE_LOG("ForStatement::evaluate");
+    if (initializer) {
+      initializer->evaluate(chain);
+    }
+    while (!condition || is_truthy(condition->evaluate(chain))) {
+      auto value = statement.evaluate(chain);
+      if (value) {
+        return value;
+      }
+      if (incrementor) {
+        incrementor->evaluate(chain);
+      }
+      Execution::safepoint();
+      if (profile_.back_edge(chain, condition, incrementor, statement)) {
+        break;
+      }
+    }
+    return nullptr;
+  }
+  
+  StatementKind getKind() const override { return kind; }
+  
+  void tier_up() const override {
+    profile_.request_compile(condition, incrementor, statement);
+    statement.tier_up();
+  }
+  
+  std::string serialize() const override {
+    return "for (" + (initializer ? initializer->serialize() : "") + "; " +
+      (condition ? condition->serialize() : "") + "; " +
+      (incrementor ? incrementor->serialize() : "") + ") {\n" + statement.serialize("  ") + "}";
+  }
+  
+private:
+  mutable LoopProfile profile_;
+};
+
+// Compiled loop tier.
+//
+// A hot loop is compiled into a tree of closures working on unboxed doubles
+// stored in slots, one slot per variable the loop touches. Booleans are kept
+// as 0 and 1. Only numeric code is supported: calls, returns, strings and so
+// on leave the loop in the interpreter.
+using CompiledCode = std::function<double(double *slots)>;
+
+enum class CompiledType {
+  Number,
+  Boolean,
+};
+
+struct Compiled {
+  CompiledType type;
+  CompiledCode code;
+};
+
+class CompiledLoop {
+public:
+  std::vector<std::string> names;
+  std::vector<bool> written;
+  CompiledCode code;
+  
+  // Moves a running loop into compiled code: live variables are carried over
+  // from the chain into slots, and the ones the loop wrote are stored back
+  // when it finishes, or when a safepoint terminates it. Returns false if a
+  // variable isn't a number.
+  bool enter(Chain &chain) const {
+    std::vector<double> slots(names.size());
+    
+    for (std::size_t i = 0; i != names.size(); ++i) {
+      auto number = std::dynamic_pointer_cast<JSNumber>(chain.lookup_value(names[i]));
+      if (!number) {
+        return false;
+      }
+      slots[i] = number->value;
+    }
+    
+    try {
+      code(slots.data());
+    } catch (...) {
+      store(chain, slots);
+      throw;
+    }
+    store(chain, slots);
+    
+    return true;
+  }
+  
+private:
+  void store(Chain &chain, const std::vector<double> &slots) const {
+    for (std::size_t i = 0; i != names.size(); ++i) {
+      if (written[i]) {
+        chain.assign_value(names[i], Heap::make<JSNumber>(slots[i]));
+      }
+    }
+  }
+};
+
+class LoopCompiler {
+public:
+  std::shared_ptr<CompiledLoop> compile(const Expression *condition, const Expression *incrementor,
+                                        const Block &statement) {
+    auto code = compile_loop(condition, incrementor, statement);
+    if (!code) {
+      return nullptr;
+    }
+    
+    auto loop = std::make_shared<CompiledLoop>();
+    loop->names = names_;
+    loop->written = written_;
+    loop->code = code;
+    return loop;
+  }
+  
+private:
+  std::vector<std::string> names_;
+  std::vector<bool> written_;
+  
+  std::size_t slot(const std::string &name) {
+    for (std::size_t i = 0; i != names_.size(); ++i) {
+      if (names_[i] == name) {
+        return i;
+      }
+    }
+    names_.push_back(name);
+    written_.push_back(false);
+    return names_.size() - 1;
+  }
+  
+  std::optional<Compiled> compile_expression(const Expression &expression) {
+    if (auto identifier = dynamic_cast<const Identifier *>(&expression)) {
+      auto index = slot(identifier->text);
+      return Compiled{CompiledType::Number, [index](double *slots) { return slots[index]; }};
+    }
+    
+    if (auto literal = dynamic_cast<const NumericLiteral *>(&expression)) {
+      auto value = std::stod(literal->text);
+      return Compiled{CompiledType::Number, [value](double *slots) { return value; }};
+    }
+    
+    if (dynamic_cast<const TrueKeyword *>(&expression)) {
+      return Compiled{CompiledType::Boolean, [](double *slots) { return 1.0; }};
+    }
+    
+    if (dynamic_cast<const FalseKeyword *>(&expression)) {
+      return Compiled{CompiledType::Boolean, [](double *slots) { return 0.0; }};
+    }
+    
+    if (auto conditional = dynamic_cast<const ConditionalExpression *>(&expression)) {
+      auto condition = compile_expression(*conditional->condition);
+      auto whenTrue = compile_expression(*conditional->whenTrue);
+      auto whenFalse = compile_expression(*conditional->whenFalse);
+      if (!condition || condition->type != CompiledType::Boolean ||
+          !whenTrue || !whenFalse || whenTrue->type != whenFalse->type) {
+        return std::nullopt;
+      }
+      auto c = condition->code, t = whenTrue->code, f = whenFalse->code;
+      return Compiled{whenTrue->type, [c, t, f](double *slots) {
+        return c(slots) != 0 ? t(slots) : f(slots);
+      }};
+    }
+    
+    if (auto binary = dynamic_cast<const BinaryExpression *>(&expression)) {
+      return compile_binary(*binary);
+    }
+    
+    return std::nullopt;
+  }
+  
+  std::optional<Compiled> compile_binary(const BinaryExpression &binary) {
+    auto right = compile_expression(*binary.right);
+    if (!right || right->type != CompiledType::Number) {
+      return std::nullopt;
+    }
+    auto r = right->code;
+    
+    if (binary.operatorToken == Token::Equals) {
+      auto identifier = std::dynamic_pointer_cast<Identifier>(binary.left);
+      if (!identifier) {
+        return std::nullopt;
+      }
+      auto index = slot(identifier->text);
+      written_[index] = true;
+      return Compiled{CompiledType::Number, [index, r](double *slots) {
+        return slots[index] = r(slots);
+      }};
+    }
+    
+    auto left = compile_expression(*binary.left);
+    if (!left || left->type != CompiledType::Number) {
+      return std::nullopt;
+    }
+    auto l = left->code;
+    
+    switch (binary.operatorToken) {
+      case Token::Plus:
+        return Compiled{CompiledType::Number, [l, r](double *slots) { return l(slots) + r(slots); }};
+      case Token::Minus:
+        return Compiled{CompiledType::Number, [l, r](double *slots) { return l(slots) - r(slots); }};
+      case Token::EqualsEqualsEquals:
+        // Same comparison as JSNumber::equalsequalsequals_operator
+        return Compiled{CompiledType::Boolean, [l, r](double *slots) {
+          return fabs(l(slots) - r(slots)) < 0.0001f ? 1.0 : 0.0;
+        }};
+      case Token::LessThan:
+        return Compiled{CompiledType::Boolean, [l, r](double *slots) {
+          return l(slots) < r(slots) ? 1.0 : 0.0;
+        }};
+      default:
+        return std::nullopt;
+    }
+  }
+  
+  CompiledCode compile_statement(const Statement &statement) {
+    switch (statement.getKind()) {
+      case StatementKind::Expression: {
+        auto expression = compile_expression(*static_cast<const ExpressionStatement &>(statement).expression);
+        return expression ? expression->code : nullptr;
+      }
+      case StatementKind::VariableStatement: {
+        std::vector<CompiledCode> assignments;
+        for (const auto &declaration : static_cast<const VariableStatement &>(statement).declarationList_.declarations) {
+          auto initializer = compile_expression(*declaration.initializer);
+          if (!initializer || initializer->type != CompiledType::Number) {
+            return nullptr;
+          }
+          auto index = slot(declaration.name.text);
+          written_[index] = true;
+          auto i = initializer->code;
+          assignments.push_back([index, i](double *slots) { return slots[index] = i(slots); });
+        }
+        return [assignments](double *slots) {
+          for (const auto &assignment : assignments) {
+            assignment(slots);
+          }
+          return 0.0;
+        };
+      }
+      case StatementKind::If: {
+        auto &if_statement = static_cast<const IfStatement &>(statement);
+        auto condition = compile_expression(*if_statement.expression);
+        auto then = compile_block(if_statement.thenStatement);
+        if (!condition || condition->type != CompiledType::Boolean || !then) {
+          return nullptr;
+        }
+        auto c = condition->code;
+        return [c, then](double *slots) { return c(slots) != 0 ? then(slots) : 0.0; };
+      }
+      case StatementKind::While: {
+        auto &while_statement = static_cast<const WhileStatement &>(statement);
+        return compile_loop(while_statement.expression.get(), nullptr, while_statement.statement);
+      }
+      case StatementKind::For: {
+        auto &for_statement = static_cast<const ForStatement &>(statement);
+        CompiledCode initializer = [](double *slots) { return 0.0; };
+        if (for_statement.initializer) {
+          initializer = compile_statement(*for_statement.initializer);
+        }
+        auto loop = compile_loop(for_statement.condition.get(), for_statement.incrementor.get(),
+                                 for_statement.statement);
+        if (!initializer || !loop) {
+          return nullptr;
+        }
+        return [initializer, loop](double *slots) {
+          initializer(slots);
+          return loop(slots);
+        };
+      }
+      default:
+        return nullptr;
+    }
+  }
+  
+  CompiledCode compile_block(const Block &block) {
+    std::vector<CompiledCode> statements;
+    for (const auto &statement : block.statements) {
+      auto code = compile_statement(*statement);
+      if (!code) {
+        return nullptr;
+      }
+      statements.push_back(code);
+    }
+    return [statements](double *slots) {
+      for (const auto &statement : statements) {
+        statement(slots);
+      }
+      return 0.0;
+    };
+  }
+  
+  CompiledCode compile_loop(const Expression *condition, const Expression *incrementor, const Block &statement) {
+    CompiledCode c = [](double *slots) { return 1.0; };
+    if (condition) {
+      auto compiled = compile_expression(*condition);
+      if (!compiled || compiled->type != CompiledType::Boolean) {
+        return nullptr;
+      }
+      c = compiled->code;
+    }
+    
+    CompiledCode i = [](double *slots) { return 0.0; };
+    if (incrementor) {
+      auto compiled = compile_expression(*incrementor);
+      if (!compiled) {
+        return nullptr;
+      }
+      i = compiled->code;
+    }
+    
+    auto body = compile_block(statement);
+    if (!body) {
+      return nullptr;
+    }
+    
+    return [c, i, body](double *slots) {
+      while (c(slots) != 0) {
+        body(slots);
+        i(slots);
+        Execution::safepoint();
+      }
+      return 0.0;
+    };
+  }
+};
+
+bool LoopProfile::back_edge(Chain &chain, const std::shared_ptr<Expression> &condition,
+                            const std::shared_ptr<Expression> &incrementor, const Block &statement) {
+  auto back_edges = back_edges_.load(std::memory_order_relaxed) + 1;
+  back_edges_.store(back_edges, std::memory_order_relaxed);
+  
+  switch (code_->state.load(std::memory_order_acquire)) {
+    case State::Interpreted:
+      if (back_edges >= kOsrThreshold) {
+        request_compile(condition, incrementor, statement);
+      }
+      return false;
+    case State::Queued:
+    case State::Failed:
+      return false;
+    case State::Compiled:
+      break;
+  }
+  
+  if (back_edges < next_entry_.load(std::memory_order_relaxed)) {
+    return false;
+  }
+  
+  TRACE_LOG("LoopProfile::back_edge, on-stack replacement after", back_edges, "iteration(s)");
+  if (code_->compiled->enter(chain)) {
+    return true;
+  }
+  // Some variable isn't a number yet, try again later
+  next_entry_.store(back_edges + kOsrThreshold, std::memory_order_relaxed);
+  return false;
+}
+
+void LoopProfile::request_compile(const std::shared_ptr<Expression> &condition,
+                                  const std::shared_ptr<Expression> &incrementor, const Block &statement) {
+  auto expected = State::Interpreted;
+  if (!code_->state.compare_exchange_strong(expected, State::Queued, std::memory_order_relaxed)) {
+    return;
+  }
+  
+  auto code = code_;
+  CompileQueue::shared().enqueue([code, condition, incrementor, statement] {
+    code->compiled = LoopCompiler{}.compile(condition.get(), incrementor.get(), statement);
+    if (!code->compiled) {
+      TRACE_LOG("LoopProfile::request_compile, loop is not compilable");
+    }
+    code->state.store(code->compiled ? State::Compiled : State::Failed, std::memory_order_release);
+  });
+}
+
+// Generators
+//
+// A generator can't suspend in the middle of the recursive evaluation of its
+// body, so the body is lowered to a flat list of instructions: control flow
+// becomes jumps and every other statement is evaluated as usual. Its
+// variables live in a heap scope. Suspending at a yield saves the index of
+// the next instruction, and resuming continues from there: a resume costs
+// no more than a call, no thread or stack is captured.
+struct GeneratorInstruction {
+  enum class Op : uint8_t {
+    // Evaluates statement
+    Execute,
+    // Evaluates expression
+    Evaluate,
+    // Declares target with the value of expression
+    Declare,
+    Jump,
+    JumpIfFalse,
+    // Suspends with the value of expression. On resume the value passed to
+    // next() is declared as, or assigned to, target if there is one.
+    Yield,
+    Return,
+  };
+  
+  Op op;
+  const Statement *statement = nullptr;
+  const Expression *expression = nullptr;
+  const Identifier *target = nullptr;
+  bool declare = false;
+  std::size_t jump = 0;
+};
+
+class GeneratorCode {
+public:
+  std::vector<GeneratorInstruction> instructions;
+  
+  GeneratorCode(const Block &body) {
+    lower(body);
+  }
+  
+private:
+  using Op = GeneratorInstruction::Op;
+  
+  std::size_t emit(GeneratorInstruction instruction) {
+    instructions.push_back(instruction);
+    return instructions.size() - 1;
+  }
+  
+  void lower(const Block &block) {
+    for (const auto &statement : block.statements) {
+      lower(*statement);
+    }
+  }
+  
+  // The parser only allows yield in the places handled here
+  void lower(const Statement &statement) {
+    switch (statement.getKind()) {
+      case StatementKind::VariableStatement:
+        for (const auto &declaration : static_cast<const VariableStatement &>(statement).declarationList_.declarations) {
+          if (auto yield = dynamic_cast<const YieldExpression *>(declaration.initializer.get())) {
+            emit({Op::Yield, nullptr, yield->expression.get(), &declaration.name, true});
+          } else {
+            emit({Op::Declare, nullptr, declaration.initializer.get(), &declaration.name, true});
+          }
+        }
+        break;
+      case StatementKind::Expression: {
+        auto expression = static_cast<const ExpressionStatement &>(statement).expression.get();
+        if (auto yield = dynamic_cast<const YieldExpression *>(expression)) {
+          emit({Op::Yield, nullptr, yield->expression.get()});
+        } else if (auto assignment = dynamic_cast<const BinaryExpression *>(expression);
+                   assignment && assignment->operatorToken == Token::Equals &&
+                   dynamic_cast<const YieldExpression *>(assignment->right.get())) {
+          auto yield = static_cast<const YieldExpression *>(assignment->right.get());
+          auto target = static_cast<const Identifier *>(assignment->left.get());
+          emit({Op::Yield, nullptr, yield->expression.get(), target, false});
+        } else {
+          emit({Op::Execute, &statement});
+        }
+        break;
+      }
+      case StatementKind::Return:
+        emit({Op::Return, nullptr, static_cast<const ReturnStatement &>(statement).expression.get()});
+        break;
+      case StatementKind::If: {
+        auto &if_statement = static_cast<const IfStatement &>(statement);
+        auto skip = emit({Op::JumpIfFalse, nullptr, if_statement.expression.get()});
+        lower(if_statement.thenStatement);
+        instructions[skip].jump = instructions.size();
+        break;
+      }
+      case StatementKind::While: {
+        auto &while_statement = static_cast<const WhileStatement &>(statement);
+        auto start = instructions.size();
+        auto exit = emit({Op::JumpIfFalse, nullptr, while_statement.expression.get()});
+        lower(while_statement.statement);
+        emit({Op::Jump, nullptr, nullptr, nullptr, false, start});
+        instructions[exit].jump = instructions.size();
+        break;
+      }
+      case StatementKind::For: {
+        auto &for_statement = static_cast<const ForStatement &>(statement);
+        if (for_statement.initializer) {
+          lower(*for_statement.initializer);
+        }
+        auto start = instructions.size();
+        std::optional<std::size_t> exit;
+        if (for_statement.condition) {
+          exit = emit({Op::JumpIfFalse, nullptr, for_statement.condition.get()});
+        }
+        lower(for_statement.statement);
+        if (for_statement.incrementor) {
+          emit({Op::Evaluate, nullptr, for_statement.incrementor.get()});
+        }
+        emit({Op::Jump, nullptr, nullptr, nullptr, false, start});
+        if (exit) {
+          instructions[*exit].jump = instructions.size();
+        }
+        break;
+      }
+      case StatementKind::FunctionDeclaration:
+        emit({Op::Execute, &statement});
+        break;
+    }
+  }
+};
+
+// Iterator returned by a generator function. next() runs the body up to the
+// following yield and returns an object with the yielded value and whether
+// the generator is done.
+class JSGenerator : public JSObject, public std::enable_shared_from_this<JSGenerator> {
+public:
+  JSGenerator(std::shared_ptr<const FunctionDeclaration> declaration, const Chain &chain)
+  : declaration_(declaration), code_(declaration_->generator_code()), chain_(chain) {};
+  
+  std::string serialize() const override { return "Generator {}"; };
+  
+  std::shared_ptr<JSValue> get_property(const std::string name) const override {
+    if (name != "next") {
+      return JSObject::get_property(name);
+    }
+    
+    // Made once, loops call next() on every step. It lives inside the
+    // generator and shares its ownership, like the methods of JSPromise, so
+    // it keeps a temporary generator alive without forming a cycle.
+    auto generator = const_cast<JSGenerator *>(this);
+    if (!next_) {
+      next_.emplace("next", [generator](Chain &chain, std::vector<std::shared_ptr<JSValue>> values) {
+        return generator->next(argument_at(values, 0));
+      });
+    }
+    return std::shared_ptr<JSValue>(generator->shared_from_this(), &*next_);
+  }
+  
+  std::shared_ptr<JSValue> next(std::shared_ptr<JSValue> sent) {
+    switch (state_) {
+      case State::Running:
+        throw std::runtime_error("TypeError: Generator is already running");
+      case State::Completed:
+        return result(Heap::make<JSUndefined>(), true);
+      case State::Suspended:
+        break;
+    }
+    
+    state_ = State::Running;
+    try {
+      Execution::Call call;
+      PROFILE_CALL(declaration_->name);
+      if (pc_ != 0) {
+        receive(code_.instructions[pc_ - 1], sent);
+      }
+      return run();
+    } catch (...) {
+      complete();
+      throw;
+    }
+  }
+  
+private:
+  enum class State {
+    Suspended,
+    Running,
+    Completed,
+  };
+  
+  // Keeps the code alive
+  const std::shared_ptr<const FunctionDeclaration> declaration_;
+  const GeneratorCode &code_;
+  Chain chain_;
+  State state_ = State::Suspended;
+  // Next instruction to run
+  std::size_t pc_ = 0;
+  mutable std::optional<JSNativeFunction> next_;
+  
+  std::shared_ptr<JSValue> run() {
+    using Op = GeneratorInstruction::Op;
+    const auto &instructions = code_.instructions;
+    
+    while (pc_ != instructions.size()) {
+      const auto &instruction = instructions[pc_++];
+      switch (instruction.op) {
+        case Op::Execute:
+          instruction.statement->evaluate(chain_);
+          break;
+        case Op::Evaluate:
+          instruction.expression->evaluate(chain_);
+          break;
+        case Op::Declare:
+          chain_.set_value(instruction.target->text, instruction.expression->evaluate(chain_));
+          break;
+        case Op::Jump:
+          // Back-edge of a loop
+          Execution::safepoint();
+          pc_ = instruction.jump;
+          break;
+        case Op::JumpIfFalse:
+          if (!is_truthy(instruction.expression->evaluate(chain_))) {
+            pc_ = instruction.jump;
+          }
+          break;
+        case Op::Yield: {
+          auto value = instruction.expression->evaluate(chain_);
+          state_ = State::Suspended;
+          return result(value, false);
+        }
+        case Op::Return: {
+          auto value = instruction.expression ? instruction.expression->evaluate(chain_) : nullptr;
+          complete();
+          return result(value ? value : Heap::make<JSUndefined>(), true);
+        }
+      }
+    }
+    
+    complete();
+    return result(Heap::make<JSUndefined>(), true);
+  }
+  
+  void receive(const GeneratorInstruction &yield, std::shared_ptr<JSValue> sent) {
+    if (!yield.target) {
+      return;
+    }
+    if (yield.declare) {
+      chain_.set_value(yield.target->text, sent);
+    } else {
+      yield.target->assign(chain_, sent);
+    }
+  }
+  
+  // Lets go of the variables
+  void complete() {
+    state_ = State::Completed;
+    chain_ = Chain();
+  }
+  
+  static std::shared_ptr<JSValue> result(std::shared_ptr<JSValue> value, bool done) {
+    auto object = Heap::make<JSObject>();
+    object->properties.insert({"value", value});
+    object->properties.insert({"done", JSBoolean::from(done)});
+    return object;
+  }
+};
+
+std::shared_ptr<JSValue> create_generator(const JSFunction &function, std::vector<std::shared_ptr<JSValue>> values) {
+  const auto &declaration = *function.declaration;
+  const auto &locals = declaration.locals();
+  
+  auto scope = Heap::make<Scope>();
+  if (auto heap = Heap::current()) {
+    heap->track(scope);
+  }
+  TRACE_EVENT(TraceKind::Allocation, Trace::scope_name(), sizeof(Scope));
+  scope->parent = function.local_chain_.scope;
+  for (std::size_t i = 0; i != declaration.parameters.size(); ++i) {
+    auto value = i < values.size() ? values[i] : Heap::make<JSUndefined>();
+    scope->values.insert({locals[i], value});
+  }
+  
+  auto chain = function.local_chain_;
+  chain.scope = scope;
+  TRACE_EVENT(TraceKind::Allocation, Trace::generator_name(), sizeof(JSGenerator));
+  return Heap::make<JSGenerator>(function.declaration, chain);
+}
+
+class SourceFile {
+public:
+  const std::string fileName;
+  std::vector<std::shared_ptr<Statement>> statements;
+  
+  void evaluate(Chain &chain) const {
+    TRACE_LOG("SourceFile::evaluate");
+    for (const auto &statement : statements) {
+      statement->evaluate(chain);
+    }
+  }
+  
+  std::string serialize() {
+    std::string result = "";
+    
+    for (const auto &statement : statements) {
+      result += statement->serialize() + "\n";
+    }
+    
+    return result;
+  }
+};
+
+void Chain::load(const SourceFile &sourceFile) {
+  sourceFile.evaluate(*this);
+}
+
+Chain Chain::captured() const {
+  auto result = *this;
+  result.frame = nullptr;
+  return result;
+}
+
+std::string Scope::serialize() const {
+  std::string result = "Scope {";
+  
+  bool first = true;
+  for (const auto &value : values) {
+    if (!first) {
+      result += ", ";
+    }
+    result += value.first + " = " + value.second->serialize();
+    first = false;
+  }
+  
+  return result + "}";
+};
+
+std::string Chain::serialize() const {
+  std::string result = "Chain {";
+  
+  bool first = true;
+  if (frame) {
+    result += frame->serialize();
+    first = false;
+  }
+  for (auto current = scope.get(); current; current = current->parent.get()) {
+    if (!first) {
+      result += ", ";
+    }
+    result += current->serialize();
+    first = false;
+  }
+  
+  return result + "}";
+};
+
+std::shared_ptr<JSValue> Chain::lookup_value(const std::string name) const {
+  if (frame) {
+    auto index = frame->find(name);
+    if (index != -1) {
+      auto value = frame->slot(index);
+      return value ? value : Heap::make<JSUndefined>();
+    }
+  }
+  for (auto current = scope.get(); current; current = current->parent.get()) {
+    auto it = current->values.find(name);
+    if (it != current->values.end()) {
+      return it->second;
+    }
+  }
+  if (builtins) {
+    auto it = builtins->values.find(name);
+    if (it != builtins->values.end()) {
+      return it->second;
+    }
+  }
+  return Heap::make<JSUndefined>();
+}
+
+void Chain::set_value(const std::string name, std::shared_ptr<JSValue> value) {
+  if (frame) {
+    auto index = frame->find(name);
+    if (index != -1) {
+      frame->slot(index) = value;
+      return;
+    }
+  }
+  scope->values.insert_or_assign(name, value);
+}
+
+void Chain::assign_value(const std::string name, std::shared_ptr<JSValue> value) {
+  if (frame) {
+    auto index = frame->find(name);
+    if (index != -1) {
+      frame->slot(index) = value;
+      return;
+    }
+  }
+  auto global = scope.get();
+  for (auto current = scope.get(); current; current = current->parent.get()) {
+    auto it = current->values.find(name);
+    if (it != current->values.end()) {
+      it->second = value;
+      return;
+    }
+    global = current;
+  }
+  // Like sloppy mode, assigning an undeclared name creates a global
+  global->values.insert_or_assign(name, value);
+}
+
+// Event loop
+//
+// Jobs (microtasks) live in a ring buffer and are drained in batches after
+// the script and after every timer. Timers live in a hierarchical timer wheel
+// with a resolution of one millisecond.
+struct Job {
+  std::shared_ptr<JSValue> callback;
+  std::shared_ptr<JSValue> argument;
+  // Resolved with the result of the callback, if set, or rejected if the
+  // callback throws
+  std::shared_ptr<JSPromise> promise;
+  // Without a callback the argument is passed through to the promise as a
+  // rejection reason rather than a value
+  bool rejected = false;
+};
+
+class JobQueue {
+public:
+  bool empty() const { return head_ == tail_; }
+  std::size_t size() const { return tail_ - head_; }
+  
+  void push(Job job) {
+    if (size() == jobs_.size()) {
+      grow();
+    }
+    jobs_[tail_++ & (jobs_.size() - 1)] = std::move(job);
+  }
+  
+  Job pop() {
+    return std::move(jobs_[head_++ & (jobs_.size() - 1)]);
+  }
+  
+private:
+  // Capacity is always a power of two, head_ and tail_ only grow
+  std::vector<Job> jobs_ = std::vector<Job>(64);
+  std::size_t head_ = 0;
+  std::size_t tail_ = 0;
+  
+  void grow() {
+    std::vector<Job> jobs(jobs_.size() * 2);
+    for (std::size_t i = head_; i != tail_; ++i) {
+      jobs[i - head_] = std::move(jobs_[i & (jobs_.size() - 1)]);
+    }
+    tail_ -= head_;
+    head_ = 0;
+    jobs_.swap(jobs);
+  }
+};
+
+struct Timer {
+  uint64_t id;
+  uint64_t expiry;
+  std::shared_ptr<JSValue> callback;
+  std::vector<std::shared_ptr<JSValue>> arguments;
+};
+
+class TimerWheel {
+public:
+  static const int kLevels = 4;
+  static const int kSlotBits = 6;
+  static const uint64_t kSlots = 1 << kSlotBits;
+  
+  uint64_t now() const { return current_; }
+  bool empty() const { return size_ == 0; }
+  
+  void schedule(Timer timer) {
+    ++size_;
+    insert(std::move(timer));
+  }
+  
+  // Advances the wheel by one tick and appends the timers that expired, in
+  // the order they have to run.
+  void tick(std::vector<Timer> &expired) {
+    ++current_;
+    
+    // Cascade timers down from the levels that just wrapped around, the
+    // highest level first so they can end up in the current slot.
+    for (int level = kLevels - 1; level > 0; --level) {
+      if ((current_ & ((uint64_t(1) << (level * kSlotBits)) - 1)) == 0) {
+        auto timers = std::move(slots_[level][slot_index(level, current_)]);
+        slots_[level][slot_index(level, current_)].clear();
+        for (auto &timer : timers) {
+          insert(std::move(timer));
+        }
+      }
+    }
+    
+    auto &slot = slots_[0][slot_index(0, current_)];
+    auto first = expired.size();
+    for (auto &timer : slot) {
+      expired.push_back(std::move(timer));
+    }
+    slot.clear();
+    size_ -= expired.size() - first;
+    
+    std::sort(expired.begin() + first, expired.end(), [](const Timer &a, const Timer &b) {
+      return a.expiry != b.expiry ? a.expiry < b.expiry : a.id < b.id;
+    });
+  }
+  
+  // The first tick after now at which tick() has something to do: a timer
+  // expires or a slot cascades down. Nothing happens before it, so the
+  // event loop can sleep until then.
+  uint64_t next_event() const {
+    auto result = UINT64_MAX;
+    for (int level = 0; level != kLevels; ++level) {
+      auto shift = level * kSlotBits;
+      for (uint64_t i = 1; i <= kSlots; ++i) {
+        auto tick = ((current_ >> shift) + i) << shift;
+        if (!slots_[level][slot_index(level, tick)].empty()) {
+          result = std::min(result, tick);
+          break;
+        }
+      }
+    }
+    return result;
+  }
+  
+private:
+  std::vector<Timer> slots_[kLevels][kSlots];
+  uint64_t current_ = 0;
+  std::size_t size_ = 0;
+  
+  static std::size_t slot_index(int level, uint64_t tick) {
+    return (tick >> (level * kSlotBits)) & (kSlots - 1);
+  }
+  
+  void insert(Timer timer) {
+    auto expiry = std::max(timer.expiry, current_);
+    auto delta = expiry - current_;
+    
+    for (int level = 0; level != kLevels; ++level) {
+      if (delta < (uint64_t(1) << ((level + 1) * kSlotBits))) {
+        slots_[level][slot_index(level, expiry)].push_back(std::move(timer));
+        return;
+      }
+    }
+    
+    // Too far away for the wheel: park it in the top level, it gets
+    // re-inserted with a smaller delta when that slot cascades.
+    auto parked = current_ + (uint64_t(1) << (kLevels * kSlotBits)) - 1;
+    slots_[kLevels - 1][slot_index(kLevels - 1, parked)].push_back(std::move(timer));
+  }
+};
+
+class EventLoop {
+public:
+  EventLoop() : start_(std::chrono::steady_clock::now()) {};
+  EventLoop(const EventLoop &) = delete;
+  
+  void enqueue_job(Job job) {
+    jobs_.push(std::move(job));
+  }
+  
+  uint64_t set_timeout(std::shared_ptr<JSValue> callback, double delay,
+                       std::vector<std::shared_ptr<JSValue>> arguments) {
+    auto id = next_timer_id_++;
+    auto ticks = delay >= 1 ? uint64_t(delay) : 1;
+    timers_.schedule(Timer{id, elapsed() + ticks, callback, arguments});
+    return id;
+  }
+  
+  // Runs jobs and timers until there is nothing left to do. An error thrown
+  // by a timer leaves run(), the timers that expired with it run on the next
+  // call.
+  void run(Chain &chain) {
+    run_jobs(chain);
+    run_expired(chain);
+    
+    std::vector<Timer> expired;
+    while (!timers_.empty()) {
+      auto now = elapsed();
+      if (timers_.now() >= now) {
+        std::this_thread::sleep_until(start_ + std::chrono::milliseconds(timers_.next_event()));
+        continue;
+      }
+      
+      while (timers_.now() < now && !timers_.empty()) {
+        timers_.tick(expired);
+        expired_.insert(expired_.end(), std::make_move_iterator(expired.begin()), std::make_move_iterator(expired.end()));
+        expired.clear();
+        run_expired(chain);
+      }
+    }
+  }
+  
+  void install(Scope &scope) {
+    auto event_loop = this;
+    
+    scope.values.insert({ "setTimeout", Heap::make<JSNativeFunction>("setTimeout", [event_loop](Chain &chain, std::vector<std::shared_ptr<JSValue>> values) {
+      std::vector<std::shared_ptr<JSValue>> arguments;
+      if (values.size() > 2) {
+        arguments.assign(values.begin() + 2, values.end());
+      }
+      auto id = event_loop->set_timeout(argument_at(values, 0), argument_at(values, 1)->as_number()->value, arguments);
+      return Heap::make<JSNumber>(id);
+    }) });
+    
+    scope.values.insert({ "queueMicrotask", Heap::make<JSNativeFunction>("queueMicrotask", [event_loop](Chain &chain, std::vector<std::shared_ptr<JSValue>> values) {
+      event_loop->enqueue_job(Job{argument_at(values, 0), nullptr, nullptr});
+      return Heap::make<JSUndefined>();
+    }) });
+    
+    auto promise_constructor = Heap::make<JSNativeFunction>("Promise", [](Chain &chain, std::vector<std::shared_ptr<JSValue>> values) -> std::shared_ptr<JSValue> {
+      throw std::runtime_error("TypeError: Promise constructor cannot be invoked without 'new'");
+    }, [event_loop](Chain &chain, std::vector<std::shared_ptr<JSValue>> values) {
+      auto promise = Heap::make<JSPromise>(*event_loop);
+      auto resolve = Heap::make<JSNativeFunction>("resolve", [promise](Chain &chain, std::vector<std::shared_ptr<JSValue>> values) {
+        promise->resolve(argument_at(values, 0));
+        return Heap::make<JSUndefined>();
+      });
+      auto reject = Heap::make<JSNativeFunction>("reject", [promise](Chain &chain, std::vector<std::shared_ptr<JSValue>> values) {
+        promise->reject(argument_at(values, 0));
+        return Heap::make<JSUndefined>();
+      });
+      try {
+        argument_at(values, 0)->call(chain, { resolve, reject });
+      } catch (const std::runtime_error &error) {
+        if (!is_catchable(error)) {
+          throw;
+        }
+        promise->reject(Heap::make<JSString>(error.what()));
+      }
+      return promise;
+    });
+    promise_constructor->properties.insert({ "resolve", Heap::make<JSNativeFunction>("resolve", [event_loop](Chain &chain, std::vector<std::shared_ptr<JSValue>> values) -> std::shared_ptr<JSValue> {
+      auto value = argument_at(values, 0);
+      if (std::dynamic_pointer_cast<JSPromise>(value)) {
+        return value;
+      }
+      auto promise = Heap::make<JSPromise>(*event_loop);
+      promise->resolve(value);
+      return promise;
+    }) });
+    scope.values.insert({ "Promise", promise_constructor });
+  }
+  
+private:
+  JobQueue jobs_;
+  TimerWheel timers_;
+  // Taken off the wheel, not run yet
+  std::deque<Timer> expired_;
+  uint64_t next_timer_id_ = 1;
+  const std::chrono::steady_clock::time_point start_;
+  
+  uint64_t elapsed() const {
+    auto duration = std::chrono::steady_clock::now() - start_;
+    return std::chrono::duration_cast<std::chrono::milliseconds>(duration).count();
+  }
+  
+  // Errors thrown by the script reject promises. Running out of fuel or
+  // memory still stops it.
+  static bool is_catchable(const std::runtime_error &error) {
+    return !dynamic_cast<const TerminationError *>(&error) && !dynamic_cast<const OutOfMemoryError *>(&error);
+  }
+  
+  void run_expired(Chain &chain) {
+    while (!expired_.empty()) {
+      auto timer = std::move(expired_.front());
+      expired_.pop_front();
+      timer.callback->call(chain, timer.arguments);
+      run_jobs(chain);
+    }
+  }
+  
+  // A job that isn't a promise reaction, e.g. from queueMicrotask, has no
+  // promise to reject: its error leaves run() and the remaining jobs run on
+  // the next call.
+  void run_jobs(Chain &chain) {
+    while (!jobs_.empty()) {
+      // Jobs queued by this batch run in the next one
+      auto batch = jobs_.size();
+      for (std::size_t i = 0; i != batch; ++i) {
+        auto job = jobs_.pop();
+        
+        if (!job.callback) {
+          // Pass-through of the outcome, e.g. to a promise that adopted
+          // another one. It is already marked as resolved, so it's settled
+          // directly.
+          if (job.promise) {
+            job.promise->settle(job.argument, job.rejected);
+          }
+          continue;
+        }
+        
+        std::vector<std::shared_ptr<JSValue>> arguments;
+        if (job.argument) {
+          arguments.push_back(job.argument);
+        }
+        if (!job.promise) {
+          job.callback->call(chain, arguments);
+          continue;
+        }
+        try {
+          job.promise->resolve(job.callback->call(chain, arguments));
+        } catch (const std::runtime_error &error) {
+          if (!is_catchable(error)) {
+            throw;
+          }
+          job.promise->reject(Heap::make<JSString>(error.what()));
+        }
+      }
+    }
+  }
+};
+
+std::shared_ptr<JSValue> JSPromise::get_property(const std::string name) const {
+  auto is_then = name == "then";
+  if (!is_then && name != "catch") {
+    return JSObject::get_property(name);
+  }
+  
+  // Made once, chains and loops look them up on every step. A method lives
+  // inside its promise and shares its ownership, so it keeps a temporary
+  // promise alive without forming a cycle.
+  auto promise = const_cast<JSPromise *>(this);
+  auto &method = is_then ? then_ : catch_;
+  if (!method) {
+    if (is_then) {
+      method.emplace("then", [promise](Chain &chain, std::vector<std::shared_ptr<JSValue>> values) {
+        return promise->then(argument_at(values, 0), argument_at(values, 1));
+      });
+    } else {
+      method.emplace("catch", [promise](Chain &chain, std::vector<std::shared_ptr<JSValue>> values) {
+        return promise->then(nullptr, argument_at(values, 0));
+      });
+    }
+  }
+  return std::shared_ptr<JSValue>(promise->shared_from_this(), &*method);
+}
+
+void JSPromise::resolve(std::shared_ptr<JSValue> value) {
+  if (resolved_) {
+    return;
+  }
+  resolved_ = true;
+  
+  if (auto promise = std::dynamic_pointer_cast<JSPromise>(value)) {
+    if (promise.get() == this) {
+      settle(Heap::make<JSString>("TypeError: Chaining cycle detected for promise"), true);
+      return;
+    }
+    promise->add_reaction(Reaction{nullptr, nullptr, shared_from_this()});
+    return;
+  }
+  
+  settle(value, false);
+}
+
+void JSPromise::reject(std::shared_ptr<JSValue> reason) {
+  if (resolved_) {
+    return;
+  }
+  resolved_ = true;
+  settle(reason, true);
+}
+
+std::shared_ptr<JSPromise> JSPromise::then(std::shared_ptr<JSValue> on_fulfilled, std::shared_ptr<JSValue> on_rejected) {
+  auto promise = Heap::make<JSPromise>(event_loop);
+  if (on_fulfilled && on_fulfilled->type != JSType::Function) {
+    on_fulfilled = nullptr;
+  }
+  if (on_rejected && on_rejected->type != JSType::Function) {
+    on_rejected = nullptr;
+  }
+  add_reaction(Reaction{on_fulfilled, on_rejected, promise});
+  return promise;
+}
+
+void JSPromise::add_reaction(Reaction reaction) {
+  if (value_) {
+    enqueue(reaction);
+  } else if (!first_reaction_.promise) {
+    first_reaction_ = std::move(reaction);
+  } else {
+    more_reactions_.push_back(std::move(reaction));
+  }
+}
+
+void JSPromise::enqueue(const Reaction &reaction) {
+  auto callback = rejected_ ? reaction.on_rejected : reaction.on_fulfilled;
+  event_loop.enqueue_job(Job{callback, value_, reaction.promise, rejected_});
+}
+
+void JSPromise::settle(std::shared_ptr<JSValue> value, bool rejected) {
+  value_ = value;
+  rejected_ = rejected;
+  
+  if (first_reaction_.promise) {
+    enqueue(first_reaction_);
+    first_reaction_ = Reaction{};
+  }
+  for (auto &reaction : more_reactions_) {
+    enqueue(reaction);
+  }
+  more_reactions_.clear();
+}
+
+// Console
+//
+// console.log appends to a large buffer that is written to the output stream
+// when it fills up or on flush(), not on every line.
+class Console {
+public:
+  static const std::size_t kBufferSize = 64 * 1024;
+  
+  Console(std::ostream &output) : output_(output) {
+    buffer_.reserve(kBufferSize);
+  }
+  
+  Console(const Console &) = delete;
+  
+  ~Console() {
+    flush();
+  }
+  
+  void write(const std::string &text) {
+    if (buffer_.size() + text.size() > kBufferSize) {
+      flush();
+    }
+    buffer_ += text;
+  }
+  
+  void flush() {
+    if (buffer_.empty()) {
+      return;
+    }
+    output_.write(buffer_.data(), buffer_.size());
+    output_.flush();
+    buffer_.clear();
+  }
+  
+  void install(Scope &scope) {
+    auto console = this;
+    auto object = Heap::make<JSObject>();
+    
+    object->properties.insert({ "log", Heap::make<JSNativeFunction>("log", [console](Chain &chain, std::vector<std::shared_ptr<JSValue>> values) {
+      for (std::size_t i = 0; i != values.size(); ++i) {
+        if (i != 0) {
+          console->write(" ");
+        }
+        console->write(values[i]->serialize());
+      }
+      console->write("\n");
+      return Heap::make<JSUndefined>();
+    }) });
+    
+    scope.values.insert({ "console", object });
+  }
+  
+private:
+  std::ostream &output_;
+  std::string buffer_;
+};
+
+// Parser
+//
+// Recursive descent parser for the subset of JavaScript the AST supports.
+// Function bodies are preparsed: they are checked for syntax errors and
+// scanned for free variables without building any nodes, and the block is
+// parsed on the first call (see FunctionDeclaration::body).
+enum class SyntaxKind {
+  Identifier,
+  NumericLiteral,
+  StringLiteral,
+  Punctuation,
+  EndOfFile,
+};
+
+struct SyntaxToken {
+  SyntaxKind kind;
+  std::string text;
+  std::size_t begin;
+  std::size_t end;
+};
+
+class Parser {
+public:
+  Parser(std::shared_ptr<const std::string> source, std::size_t position = 0)
+  : source_(source), position_(position) {
+    next();
+  }
+  
+  SourceFile parse_source_file(const std::string fileName) {
+    auto source_file = SourceFile{ fileName };
+    functions_.push_back({});
+    while (token_.kind != SyntaxKind::EndOfFile) {
+      source_file.statements.push_back(parse_statement());
+    }
+    return source_file;
+  }
+  
+  Block parse_function_body(bool is_generator = false) {
+    functions_.push_back({});
+    functions_.back().generator = is_generator;
+    return parse_block();
+  }
+  
+private:
+  struct FunctionState {
+    std::set<std::string> declared;
+    std::set<std::string> referenced;
+    bool generator = false;
+  };
+  
+  std::shared_ptr<const std::string> source_;
+  std::size_t position_;
+  SyntaxToken token_;
+  std::size_t previous_end_ = 0;
+  bool preparsing_ = false;
+  std::vector<FunctionState> functions_;
+  
+  // Lexer
+  
+  void next() {
+    const auto &source = *source_;
+    previous_end_ = token_.end;
+    
+    while (position_ < source.size()) {
+      // The <cctype> functions take unsigned chars, source bytes may be UTF-8
+      if (isspace(static_cast<unsigned char>(source[position_]))) {
+        ++position_;
+      } else if (source.compare(position_, 2, "//") == 0) {
+        while (position_ < source.size() && source[position_] != '\n') {
+          ++position_;
+        }
+      } else {
+        break;
+      }
+    }
+    
+    auto begin = position_;
+    if (position_ == source.size()) {
+      token_ = SyntaxToken{SyntaxKind::EndOfFile, "", begin, begin};
+      return;
+    }
+    
+    auto c = source[position_];
+    if (isalpha(static_cast<unsigned char>(c)) || c == '_' || c == '$') {
+      while (position_ < source.size() && (isalnum(static_cast<unsigned char>(source[position_])) ||
+                                           source[position_] == '_' || source[position_] == '$')) {
+        ++position_;
+      }
+      token_ = SyntaxToken{SyntaxKind::Identifier, source.substr(begin, position_ - begin), begin, position_};
+      return;
+    }
+    
+    if (isdigit(static_cast<unsigned char>(c))) {
+      auto digits = [&]() {
+        auto start = position_;
+        while (position_ < source.size() && isdigit(static_cast<unsigned char>(source[position_]))) {
+          ++position_;
+        }
+        return position_ != start;
+      };
+      digits();
+      if (position_ < source.size() && source[position_] == '.') {
+        ++position_;
+        digits();
+      }
+      if (position_ < source.size() && (source[position_] == 'e' || source[position_] == 'E')) {
+        ++position_;
+        if (position_ < source.size() && (source[position_] == '+' || source[position_] == '-')) {
+          ++position_;
+        }
+        if (!digits()) {
+          error("Invalid or unexpected token");
+        }
+      }
+      // std::stod would stop quietly at a second dot, as in 1.2.3
+      if (position_ < source.size() && (source[position_] == '.' || source[position_] == '_' || source[position_] == '$' ||
+                                        isalnum(static_cast<unsigned char>(source[position_])))) {
+        error("Invalid or unexpected token");
+      }
+      token_ = SyntaxToken{SyntaxKind::NumericLiteral, source.substr(begin, position_ - begin), begin, position_};
+      return;
+    }
+    
+    if (c == '"' || c == '\'') {
+      std::string text;
+      ++position_;
+      while (position_ < source.size() && source[position_] != c && source[position_] != '\n') {
+        if (source[position_] == '\\' && position_ + 1 < source.size()) {
+          ++position_;
+          text += source[position_] == 'n' ? '\n' : source[position_];
+        } else {
+          text += source[position_];
+        }
+        ++position_;
+      }
+      if (position_ == source.size() || source[position_] != c) {
+        error("Invalid or unexpected token");
+      }
+      ++position_;
+      token_ = SyntaxToken{SyntaxKind::StringLiteral, text, begin, position_};
+      return;
+    }
+    
+    for (const auto punctuation : {"===", "(", ")", "{", "}", ",", ";", ".", "=", "+", "-", "<", "?", ":", "*"}) {
+      if (source.compare(position_, strlen(punctuation), punctuation) == 0) {
+        position_ += strlen(punctuation);
+        token_ = SyntaxToken{SyntaxKind::Punctuation, punctuation, begin, position_};
+        return;
+      }
+    }
+    
+    error(std::string("Invalid or unexpected token '") + c + "'");
+  }
+  
+  [[noreturn]] void error(const std::string &message) const {
+    auto line = std::count(source_->begin(), source_->begin() + token_.begin, '\n') + 1;
+    throw std::runtime_error("SyntaxError: " + message + " (line " + std::to_string(line) + ")");
+  }
+  
+  bool at(const std::string &text) const {
+    return (token_.kind == SyntaxKind::Identifier || token_.kind == SyntaxKind::Punctuation) && token_.text == text;
+  }
+  
+  void expect(const std::string &text) {
+    if (!at(text)) {
+      error("Expected '" + text + "' but found '" + token_.text + "'");
+    }
+    next();
+  }
+  
+  std::string expect_identifier() {
+    if (token_.kind != SyntaxKind::Identifier) {
+      error("Expected identifier but found '" + token_.text + "'");
+    }
+    auto text = token_.text;
+    next();
+    return text;
+  }
+  
+  void skip_semicolon() {
+    if (at(";")) {
+      next();
+    }
+  }
+  
+  bool in_generator() const { return functions_.back().generator; }
+  
+  void declare(const std::string &name) { functions_.back().declared.insert(name); }
+  void reference(const std::string &name) { functions_.back().referenced.insert(name); }
+  
+  // Statements
+  
+  std::shared_ptr<Statement> parse_statement() {
+    if (at("function")) {
+      return parse_function_declaration();
+    }
+    if (at("let")) {
+      auto statement = parse_variable_statement();
+      skip_semicolon();
+      return statement;
+    }
+    if (at("return")) {
+      next();
+      std::shared_ptr<Expression> expression;
+      if (at(";") || at("}")) {
+        expression = preparsing_ ? nullptr : std::make_shared<Identifier>("undefined");
+      } else {
+        expression = parse_expression();
+      }
+      skip_semicolon();
+      return preparsing_ ? nullptr : std::make_shared<ReturnStatement>(expression);
+    }
+    if (at("if")) {
+      next();
+      expect("(");
+      auto expression = parse_expression();
+      expect(")");
+      auto thenStatement = parse_block_or_statement();
+      if (at("else")) {
+        error("'else' is not supported");
+      }
+      return preparsing_ ? nullptr : std::make_shared<IfStatement>(expression, thenStatement);
+    }
+    if (at("while")) {
+      next();
+      expect("(");
+      auto expression = parse_expression();
+      expect(")");
+      auto statement = parse_block_or_statement();
+      return preparsing_ ? nullptr : std::make_shared<WhileStatement>(expression, statement);
+    }
+    if (at("for")) {
+      return parse_for_statement();
+    }
+    
+    auto expression = in_generator() && at("yield") ? parse_yield() : parse_expression(true);
+    skip_semicolon();
+    return preparsing_ ? nullptr : std::make_shared<ExpressionStatement>(expression);
+  }
+  
+  std::shared_ptr<Statement> parse_function_declaration() {
+    expect("function");
+    auto is_generator = at("*");
+    if (is_generator) {
+      next();
+    }
+    auto name = expect_identifier();
+    declare(name);
+    
+    std::vector<Parameter> parameters;
+    functions_.push_back({});
+    functions_.back().generator = is_generator;
+    expect("(");
+    while (!at(")")) {
+      auto parameter = expect_identifier();
+      declare(parameter);
+      parameters.push_back(Parameter{Identifier{parameter}});
+      if (!at(")")) {
+        expect(",");
+      }
+    }
+    expect(")");
+    
+    auto preparsing = preparsing_;
+    preparsing_ = true;
+    auto begin = token_.begin;
+    parse_block();
+    auto end = previous_end_;
+    preparsing_ = preparsing;
+    
+    auto function = functions_.back();
+    functions_.pop_back();
+    std::vector<std::string> free_variables;
+    for (const auto &variable : function.referenced) {
+      if (!function.declared.count(variable)) {
+        free_variables.push_back(variable);
+        reference(variable);
+      }
+    }
+    
+    if (preparsing_) {
+      return nullptr;
+    }
+    auto body = std::make_shared<FunctionBody>(source_, begin, end, free_variables);
+    return std::make_shared<FunctionDeclaration>(Identifier{name}, body, parameters, is_generator);
+  }
+  
+  std::shared_ptr<Statement> parse_variable_statement() {
+    expect("let");
+    std::vector<VariableDeclaration> declarations;
+    do {
+      if (at(",")) {
+        next();
+      }
+      auto name = expect_identifier();
+      declare(name);
+      expect("=");
+      auto initializer = in_generator() && at("yield") ? parse_yield() : parse_expression();
+      if (!preparsing_) {
+        declarations.push_back(VariableDeclaration{Identifier{name}, initializer});
+      }
+    } while (at(","));
+    return preparsing_ ? nullptr : std::make_shared<VariableStatement>(VariableDeclarationList{declarations});
+  }
+  
+  std::shared_ptr<Statement> parse_for_statement() {
+    expect("for");
+    expect("(");
+    
+    std::shared_ptr<Statement> initializer;
+    if (at("let")) {
+      initializer = parse_variable_statement();
+    } else if (!at(";")) {
+      auto expression = parse_expression();
+      initializer = preparsing_ ? nullptr : std::make_shared<ExpressionStatement>(expression);
+    }
+    expect(";");
+    
+    std::shared_ptr<Expression> condition;
+    if (!at(";")) {
+      condition = parse_expression();
+    }
+    expect(";");
+    
+    std::shared_ptr<Expression> incrementor;
+    if (!at(")")) {
+      incrementor = parse_expression();
+    }
+    expect(")");
+    
+    auto statement = parse_block_or_statement();
+    return preparsing_ ? nullptr : std::make_shared<ForStatement>(initializer, condition, incrementor, statement);
+  }
+  
+  Block parse_block() {
+    std::vector<std::shared_ptr<Statement>> statements;
+    expect("{");
+    while (!at("}")) {
+      if (token_.kind == SyntaxKind::EndOfFile) {
+        error("Unexpected end of input");
+      }
+      auto statement = parse_statement();
+      if (!preparsing_) {
+        statements.push_back(statement);
+      }
+    }
+    expect("}");
+    return Block(statements);
+  }
+  
+  Block parse_block_or_statement() {
+    if (at("{")) {
+      return parse_block();
+    }
+    auto statement = parse_statement();
+    return Block(preparsing_ ? std::vector<std::shared_ptr<Statement>>{} : std::vector<std::shared_ptr<Statement>>{statement});
+  }
+  
+  // Expressions, from the lowest precedence
+  
+  // A generator suspends only at statement level: a yield is a statement, a
+  // let initializer or the right side of an assignment statement
+  std::shared_ptr<Expression> parse_yield() {
+    expect("yield");
+    std::shared_ptr<Expression> expression;
+    if (at(";") || at("}")) {
+      expression = preparsing_ ? nullptr : std::make_shared<Identifier>("undefined");
+    } else {
+      expression = parse_expression();
+    }
+    return preparsing_ ? nullptr : std::make_shared<YieldExpression>(expression);
+  }
+  
+  std::shared_ptr<Expression> parse_expression(bool statement = false) {
+    auto first = token_;
+    auto left = parse_conditional();
+    if (!at("=")) {
+      return left;
+    }
+    // Only a single identifier can be assigned to, this also works when preparsing
+    if (first.kind != SyntaxKind::Identifier || previous_end_ != first.end) {
+      error("Invalid left-hand side in assignment");
+    }
+    next();
+    auto right = statement && in_generator() && at("yield") ? parse_yield() : parse_expression();
+    return preparsing_ ? nullptr : std::make_shared<BinaryExpression>(left, Token::Equals, right);
+  }
+  
+  std::shared_ptr<Expression> parse_conditional() {
+    auto condition = parse_binary(0);
+    if (!at("?")) {
+      return condition;
+    }
+    next();
+    auto whenTrue = parse_expression();
+    expect(":");
+    auto whenFalse = parse_expression();
+    return preparsing_ ? nullptr : std::make_shared<ConditionalExpression>(condition, whenTrue, whenFalse);
+  }
+  
+  // Binary operators by precedence level: ===, then <, then + and -
+  std::shared_ptr<Expression> parse_binary(int level) {
+    static const std::vector<std::vector<std::pair<std::string, Token>>> levels = {
+      {{"===", Token::EqualsEqualsEquals}},
+      {{"<", Token::LessThan}},
+      {{"+", Token::Plus}, {"-", Token::Minus}},
+    };
+    
+    if (level == int(levels.size())) {
+      return parse_call();
+    }
+    
+    auto left = parse_binary(level + 1);
+    while (true) {
+      auto op = std::find_if(levels[level].begin(), levels[level].end(), [this](const auto &op) {
+        return at(op.first);
+      });
+      if (op == levels[level].end()) {
+        return left;
+      }
+      next();
+      auto right = parse_binary(level + 1);
+      left = preparsing_ ? nullptr : std::make_shared<BinaryExpression>(left, op->second, right);
+    }
+  }
+  
+  std::vector<std::shared_ptr<Expression>> parse_arguments() {
+    std::vector<std::shared_ptr<Expression>> arguments;
+    expect("(");
+    while (!at(")")) {
+      arguments.push_back(parse_expression());
+      if (!at(")")) {
+        expect(",");
+      }
+    }
+    expect(")");
+    return arguments;
+  }
+  
+  std::shared_ptr<Expression> parse_call() {
+    std::shared_ptr<Expression> expression;
+    
+    if (at("new")) {
+      next();
+      auto constructor = parse_primary();
+      while (at(".")) {
+        next();
+        auto name = expect_identifier();
+        constructor = preparsing_ ? nullptr : std::make_shared<PropertyAccessExpression>(constructor, Identifier{name});
+      }
+      auto arguments = parse_arguments();
+      expression = preparsing_ ? nullptr : std::make_shared<NewExpression>(constructor, arguments);
+    } else {
+      expression = parse_primary();
+    }
+    
+    while (true) {
+      if (at("(")) {
+        auto arguments = parse_arguments();
+        expression = preparsing_ ? nullptr : std::make_shared<CallExpression>(expression, arguments);
+      } else if (at(".")) {
+        next();
+        auto name = expect_identifier();
+        expression = preparsing_ ? nullptr : std::make_shared<PropertyAccessExpression>(expression, Identifier{name});
+      } else {
+        return expression;
+      }
+    }
+  }
+  
+  std::shared_ptr<Expression> parse_primary() {
+    if (token_.kind == SyntaxKind::NumericLiteral) {
+      auto text = token_.text;
+      next();
+      return preparsing_ ? nullptr : std::make_shared<NumericLiteral>(text);
+    }
+    if (token_.kind == SyntaxKind::StringLiteral) {
+      auto text = token_.text;
+      next();
+      return preparsing_ ? nullptr : std::make_shared<StringLiteral>(text);
+    }
+    if (at("(")) {
+      next();
+      auto expression = parse_expression();
+      expect(")");
+      return expression;
+    }
+    if (at("true") || at("false")) {
+      auto value = at("true");
+      next();
+      if (preparsing_) {
+        return nullptr;
+      }
+      if (value) {
+        return std::make_shared<TrueKeyword>();
+      }
+      return std::make_shared<FalseKeyword>();
+    }
+    
+    static const std::set<std::string> reserved = {
+      "function", "let", "return", "if", "else", "while", "for", "new", "var", "const",
+    };
+    if (token_.kind != SyntaxKind::Identifier || reserved.count(token_.text)) {
+      error("Unexpected token '" + token_.text + "'");
+    }
+    if (in_generator() && at("yield")) {
+      error("yield is only supported as a statement, a let initializer or the right side of an assignment");
+    }
+    auto name = expect_identifier();
+    reference(name);
+    return preparsing_ ? nullptr : std::make_shared<Identifier>(name);
+  }
+};
+
+const Block &FunctionDeclaration::body() const {
+  if (!body_->parsed.load(std::memory_order_acquire)) {
+    std::lock_guard<std::mutex> lock(body_->mutex);
+    if (!body_->block) {
+      TRACE_LOG("FunctionDeclaration::body, parsing", name.text);
+      body_->block = Parser(body_->source, body_->begin).parse_function_body(is_generator);
+      body_->parsed.store(true, std::memory_order_release);
+    }
+  }
+  return *body_->block;
+}
+
+const GeneratorCode &FunctionDeclaration::generator_code() const {
+  if (!body_->lowered.load(std::memory_order_acquire)) {
+    const auto &block = body();
+    std::lock_guard<std::mutex> lock(body_->mutex);
+    if (!body_->generator_code) {
+      body_->generator_code = std::make_shared<const GeneratorCode>(block);
+      body_->lowered.store(true, std::memory_order_release);
+    }
+  }
+  return *body_->generator_code;
+}
+
+bool FunctionDeclaration::has_same_code(const FunctionDeclaration &other) const {
+  if (name.text != other.name.text || is_generator != other.is_generator ||
+      parameters.size() != other.parameters.size()) {
+    return false;
+  }
+  for (std::size_t i = 0; i != parameters.size(); ++i) {
+    if (parameters[i].name.text != other.parameters[i].name.text) {
+      return false;
+    }
+  }
+  
+  // Bodies from the parser are compared without parsing them
+  const auto &body = *body_, &other_body = *other.body_;
+  if (body.source && other_body.source) {
+    return body.end - body.begin == other_body.end - other_body.begin &&
+      body.source->compare(body.begin, body.end - body.begin, *other_body.source,
+                           other_body.begin, other_body.end - other_body.begin) == 0;
+  }
+  return serialize() == other.serialize();
+}
+
+// Escape analysis
+//
+// Collects the variables a function declares and the names it refers to. The
+// scope of the function is captured if a function declared inside it refers
+// to one of its variables; otherwise its variables can live in a Frame.
+class ScopeAnalysis {
+public:
+  // Parameters first
+  std::vector<std::string> locals;
+  // Names used in the body, including the free variables of inner functions
+  std::set<std::string> references;
+  // Functions declared in the body, not counting nested ones
+  std::vector<const FunctionDeclaration *> functions;
+  // Identifiers evaluated in the body, not counting nested functions
+  std::vector<const Identifier *> identifiers;
+  
+  ScopeAnalysis(const FunctionDeclaration &declaration) {
+    for (const auto &parameter : declaration.parameters) {
+      declare(parameter.name.text);
+    }
+    visit(declaration.body());
+  }
+  
+  bool is_declared(const std::string &name) const {
+    return std::find(locals.begin(), locals.end(), name) != locals.end();
+  }
+  
+  bool is_scope_captured() const {
+    for (const auto function : functions) {
+      for (const auto &name : function->free_variables()) {
+        if (is_declared(name)) {
+          return true;
+        }
+      }
+    }
+    return false;
+  }
+  
+  std::vector<std::string> free_variables() const {
+    std::vector<std::string> result;
+    for (const auto &name : references) {
+      if (!is_declared(name)) {
+        result.push_back(name);
+      }
+    }
+    return result;
+  }
+  
+private:
+  void declare(const std::string &name) {
+    if (!is_declared(name)) {
+      locals.push_back(name);
+    }
+  }
+  
+  void visit(const Block &block) {
+    for (const auto &statement : block.statements) {
+      visit(*statement);
+    }
+  }
+  
+  void visit(const Statement &statement) {
+    switch (statement.getKind()) {
+      case StatementKind::FunctionDeclaration: {
+        auto &function = static_cast<const FunctionDeclaration &>(statement);
+        declare(function.name.text);
+        functions.push_back(&function);
+        const auto &free_variables = function.free_variables();
+        references.insert(free_variables.begin(), free_variables.end());
+        break;
+      }
+      case StatementKind::VariableStatement:
+        for (const auto &declaration : static_cast<const VariableStatement &>(statement).declarationList_.declarations) {
+          declare(declaration.name.text);
+          visit(*declaration.initializer);
+        }
+        break;
+      case StatementKind::Return:
+        visit(*static_cast<const ReturnStatement &>(statement).expression);
+        break;
+      case StatementKind::If: {
+        auto &if_statement = static_cast<const IfStatement &>(statement);
+        visit(*if_statement.expression);
+        visit(if_statement.thenStatement);
+        break;
+      }
+      case StatementKind::Expression:
+        visit(*static_cast<const ExpressionStatement &>(statement).expression);
+        break;
+      case StatementKind::While: {
+        auto &while_statement = static_cast<const WhileStatement &>(statement);
+        visit(*while_statement.expression);
+        visit(while_statement.statement);
+        break;
+      }
+      case StatementKind::For: {
+        auto &for_statement = static_cast<const ForStatement &>(statement);
+        if (for_statement.initializer) {
+          visit(*for_statement.initializer);
+        }
+        if (for_statement.condition) {
+          visit(*for_statement.condition);
+        }
+        if (for_statement.incrementor) {
+          visit(*for_statement.incrementor);
+        }
+        visit(for_statement.statement);
+        break;
+      }
+    }
+  }
+  
+  void visit(const Expression &expression) {
+    if (auto identifier = dynamic_cast<const Identifier *>(&expression)) {
+      references.insert(identifier->text);
+      identifiers.push_back(identifier);
+    } else if (auto binary = dynamic_cast<const BinaryExpression *>(&expression)) {
+      visit(*binary->left);
+      visit(*binary->right);
+    } else if (auto conditional = dynamic_cast<const ConditionalExpression *>(&expression)) {
+      visit(*conditional->condition);
+      visit(*conditional->whenTrue);
+      visit(*conditional->whenFalse);
+    } else if (auto call = dynamic_cast<const CallExpression *>(&expression)) {
+      visit(*call->expression);
+      for (const auto &argument : call->arguments) {
+        visit(*argument);
+      }
+    } else if (auto new_expression = dynamic_cast<const NewExpression *>(&expression)) {
+      visit(*new_expression->expression);
+      for (const auto &argument : new_expression->arguments) {
+        visit(*argument);
+      }
+    } else if (auto property_access = dynamic_cast<const PropertyAccessExpression *>(&expression)) {
+      visit(*property_access->expression);
+    } else if (auto yield = dynamic_cast<const YieldExpression *>(&expression)) {
+      visit(*yield->expression);
+    }
+  }
+};
+
+const std::vector<std::string> &FunctionDeclaration::free_variables() const {
+  // Known from preparsing for functions that come from the parser
+  if (!body_->has_free_variables.load(std::memory_order_acquire)) {
+    auto free_variables = ScopeAnalysis(*this).free_variables();
+    std::lock_guard<std::mutex> lock(body_->mutex);
+    if (!body_->free_variables) {
+      body_->free_variables = free_variables;
+      body_->has_free_variables.store(true, std::memory_order_release);
+    }
+  }
+  return *body_->free_variables;
+}
+
+const std::vector<std::string> &FunctionDeclaration::locals() const {
+  analyze();
+  return body_->locals;
+}
+
+bool FunctionDeclaration::is_scope_captured() const {
+  analyze();
+  return body_->scope_captured;
+}
+
+void FunctionDeclaration::analyze() const {
+  if (body_->analyzed.load(std::memory_order_acquire)) {
+    return;
+  }
+  auto analysis = ScopeAnalysis(*this);
+  std::lock_guard<std::mutex> lock(body_->mutex);
+  if (body_->analyzed.load(std::memory_order_relaxed)) {
+    return;
+  }
+  body_->locals = analysis.locals;
+  body_->scope_captured = analysis.is_scope_captured();
+  
+  // What neither this function nor an enclosing one declares is a global.
+  // An inner function only runs after this one, so it's analyzed after it
+  // got the names from here.
+  auto outer_locals = body_->outer_locals;
+  outer_locals.insert(outer_locals.end(), body_->locals.begin(), body_->locals.end());
+  for (const auto identifier : analysis.identifiers) {
+    if (std::find(outer_locals.begin(), outer_locals.end(), identifier->text) == outer_locals.end()) {
+      identifier->resolve_global();
+    }
+  }
+  for (const auto function : analysis.functions) {
+    std::lock_guard<std::mutex> function_lock(function->body_->mutex);
+    function->body_->outer_locals = outer_locals;
+  }
+  
+  body_->analyzed.store(true, std::memory_order_release);
+  TRACE_LOG("FunctionDeclaration::analyze", name.text, "scope captured =", body_->scope_captured);
+}
+
+// Purity analysis
+//
+// A function is pure if its result depends only on its arguments, so its
+// calls can be memoized (see MemoCache). It may write its own variables,
+// read globals that no loaded code assigns, and call global functions that
+// are pure themselves. It doesn't make closures, touch objects or call the
+// host. Writes to globals by the host aren't seen.
+//
+// Only the bodies of functions that refer to a global the candidate reads
+// are parsed, the preparser knows the free variables of the others.
+class PurityAnalysis {
+public:
+  PurityAnalysis(const Chain &chain, const std::vector<std::shared_ptr<const SourceFile>> &programs)
+  : chain_(chain) {
+    for (const auto &program : programs) {
+      for (const auto &statement : program->statements) {
+        collect(*statement, Where::TopLevel);
+      }
+    }
+  }
+  
+  bool is_pure(const JSValue &value) {
+    // What a function found impure left behind isn't valid for the next one
+    checked_.clear();
+    return is_pure_function(value);
+  }
+  
+private:
+  // Where a statement runs: a let or function declared at the top level of
+  // a program runs once and defines the global, unless another one defines
+  // it too; in a block it can run again
+  enum class Where {
+    TopLevel,
+    TopLevelBlock,
+    Function,
+  };
+  
+  const Chain &chain_;
+  // Names that some code assigns or declares again
+  std::set<std::string> assigned_;
+  std::set<std::string> defined_;
+  // Globals asked about, the functions referring to them are collected
+  std::set<std::string> examined_;
+  // Functions not collected yet, only preparsed as far as the analysis goes
+  std::vector<const FunctionDeclaration *> functions_;
+  std::set<const FunctionDeclaration *> checked_;
+  
+  bool is_assigned(const std::string &name) {
+    if (examined_.insert(name).second) {
+      // Collecting a function can add the ones declared in it
+      for (std::size_t i = 0; i < functions_.size();) {
+        if (refers_to(*functions_[i], name)) {
+          collect_function(i);
+        } else {
+          ++i;
+        }
+      }
+    }
+    return assigned_.count(name);
+  }
+  
+  static bool refers_to(const FunctionDeclaration &function, const std::string &name) {
+    const auto &free_variables = function.free_variables();
+    return std::find(free_variables.begin(), free_variables.end(), name) != free_variables.end();
+  }
+  
+  void collect_function(std::size_t index) {
+    auto &function = *functions_[index];
+    functions_.erase(functions_.begin() + index);
+    try {
+      collect(function.body(), Where::Function);
+    } catch (const std::runtime_error &) {
+      // A body that doesn't parse may assign anything it refers to
+      const auto &free_variables = function.free_variables();
+      assigned_.insert(free_variables.begin(), free_variables.end());
+    }
+  }
+  
+  // Functions in a body that was just collected are checked against the
+  // names examined before
+  void add_function(const FunctionDeclaration &function) {
+    for (const auto &name : examined_) {
+      if (refers_to(function, name)) {
+        functions_.push_back(&function);
+        collect_function(functions_.size() - 1);
+        return;
+      }
+    }
+    functions_.push_back(&function);
+  }
+  
+  bool is_pure_function(const JSValue &value) {
+    if (typeid(value) != typeid(JSFunction)) {
+      return false;
+    }
+    auto &function = static_cast<const JSFunction &>(value);
+    auto &declaration = *function.declaration;
+    // Its only free variables are globals
+    if (declaration.is_generator || function.local_chain_.scope.get() != chain_.global) {
+      return false;
+    }
+    // Already checked or being checked further up, a recursive call is pure
+    // if the rest of the function is
+    if (!checked_.insert(&declaration).second) {
+      return true;
+    }
+    return is_pure(declaration.body(), declaration);
+  }
+  
+  void define(const std::string &name, Where where) {
+    if (where == Where::TopLevelBlock || (where == Where::TopLevel && !defined_.insert(name).second)) {
+      assigned_.insert(name);
+    }
+  }
+  
+  void collect(const Block &block, Where where) {
+    for (const auto &statement : block.statements) {
+      collect(*statement, where);
+    }
+  }
+  
+  void collect(const Statement &statement, Where where) {
+    auto nested = where == Where::TopLevel ? Where::TopLevelBlock : where;
+    switch (statement.getKind()) {
+      case StatementKind::FunctionDeclaration: {
+        auto &function = static_cast<const FunctionDeclaration &>(statement);
+        define(function.name.text, where);
+        add_function(function);
+        break;
+      }
+      case StatementKind::VariableStatement:
+        for (const auto &declaration : static_cast<const VariableStatement &>(statement).declarationList_.declarations) {
+          define(declaration.name.text, where);
+          collect(*declaration.initializer);
+        }
+        break;
+      case StatementKind::Return:
+        collect(*static_cast<const ReturnStatement &>(statement).expression);
+        break;
+      case StatementKind::If: {
+        auto &if_statement = static_cast<const IfStatement &>(statement);
+        collect(*if_statement.expression);
+        collect(if_statement.thenStatement, nested);
+        break;
+      }
+      case StatementKind::Expression:
+        collect(*static_cast<const ExpressionStatement &>(statement).expression);
+        break;
+      case StatementKind::While: {
+        auto &while_statement = static_cast<const WhileStatement &>(statement);
+        collect(*while_statement.expression);
+        collect(while_statement.statement, nested);
+        break;
+      }
+      case StatementKind::For: {
+        auto &for_statement = static_cast<const ForStatement &>(statement);
+        if (for_statement.initializer) {
+          collect(*for_statement.initializer, nested);
+        }
+        if (for_statement.condition) {
+          collect(*for_statement.condition);
+        }
+        if (for_statement.incrementor) {
+          collect(*for_statement.incrementor);
+        }
+        collect(for_statement.statement, nested);
+        break;
+      }
+    }
+  }
+  
+  // Assignments to locals count too, which only makes the analysis more
+  // conservative
+  void collect(const Expression &expression) {
+    if (auto binary = dynamic_cast<const BinaryExpression *>(&expression)) {
+      if (binary->operatorToken == Token::Equals) {
+        if (auto identifier = dynamic_cast<const Identifier *>(binary->left.get())) {
+          assigned_.insert(identifier->text);
+        }
+      }
+      collect(*binary->left);
+      collect(*binary->right);
+    } else if (auto conditional = dynamic_cast<const ConditionalExpression *>(&expression)) {
+      collect(*conditional->condition);
+      collect(*conditional->whenTrue);
+      collect(*conditional->whenFalse);
+    } else if (auto call = dynamic_cast<const CallExpression *>(&expression)) {
+      collect(*call->expression);
+      for (const auto &argument : call->arguments) {
+        collect(*argument);
+      }
+    } else if (auto new_expression = dynamic_cast<const NewExpression *>(&expression)) {
+      collect(*new_expression->expression);
+      for (const auto &argument : new_expression->arguments) {
+        collect(*argument);
+      }
+    } else if (auto property_access = dynamic_cast<const PropertyAccessExpression *>(&expression)) {
+      collect(*property_access->expression);
+    } else if (auto yield = dynamic_cast<const YieldExpression *>(&expression)) {
+      collect(*yield->expression);
+    }
+  }
+  
+  static bool is_local(const std::string &name, const FunctionDeclaration &declaration) {
+    const auto &locals = declaration.locals();
+    return std::find(locals.begin(), locals.end(), name) != locals.end();
+  }
+  
+  bool is_pure(const Block &block, const FunctionDeclaration &declaration) {
+    for (const auto &statement : block.statements) {
+      if (!is_pure(*statement, declaration)) {
+        return false;
+      }
+    }
+    return true;
+  }
+  
+  bool is_pure(const Statement &statement, const FunctionDeclaration &declaration) {
+    switch (statement.getKind()) {
+      // A closure could outlive the call
+      case StatementKind::FunctionDeclaration:
+        return false;
+      case StatementKind::VariableStatement:
+        for (const auto &variable : static_cast<const VariableStatement &>(statement).declarationList_.declarations) {
+          if (!is_pure(*variable.initializer, declaration)) {
+            return false;
+          }
+        }
+        return true;
+      case StatementKind::Return:
+        return is_pure(*static_cast<const ReturnStatement &>(statement).expression, declaration);
+      case StatementKind::If: {
+        auto &if_statement = static_cast<const IfStatement &>(statement);
+        return is_pure(*if_statement.expression, declaration) && is_pure(if_statement.thenStatement, declaration);
+      }
+      case StatementKind::Expression:
+        return is_pure(*static_cast<const ExpressionStatement &>(statement).expression, declaration);
+      case StatementKind::While: {
+        auto &while_statement = static_cast<const WhileStatement &>(statement);
+        return is_pure(*while_statement.expression, declaration) && is_pure(while_statement.statement, declaration);
+      }
+      case StatementKind::For: {
+        auto &for_statement = static_cast<const ForStatement &>(statement);
+        return (!for_statement.initializer || is_pure(*for_statement.initializer, declaration)) &&
+          (!for_statement.condition || is_pure(*for_statement.condition, declaration)) &&
+          (!for_statement.incrementor || is_pure(*for_statement.incrementor, declaration)) &&
+          is_pure(for_statement.statement, declaration);
+      }
+    }
+    return false;
+  }
+  
+  bool is_pure(const Expression &expression, const FunctionDeclaration &declaration) {
+    if (auto identifier = dynamic_cast<const Identifier *>(&expression)) {
+      return is_local(identifier->text, declaration) || !is_assigned(identifier->text);
+    }
+    if (dynamic_cast<const NumericLiteral *>(&expression) || dynamic_cast<const StringLiteral *>(&expression) ||
+        dynamic_cast<const TrueKeyword *>(&expression) || dynamic_cast<const FalseKeyword *>(&expression)) {
+      return true;
+    }
+    if (auto binary = dynamic_cast<const BinaryExpression *>(&expression)) {
+      if (binary->operatorToken == Token::Equals) {
+        auto identifier = dynamic_cast<const Identifier *>(binary->left.get());
+        return identifier && is_local(identifier->text, declaration) && is_pure(*binary->right, declaration);
+      }
+      return is_pure(*binary->left, declaration) && is_pure(*binary->right, declaration);
+    }
+    if (auto conditional = dynamic_cast<const ConditionalExpression *>(&expression)) {
+      return is_pure(*conditional->condition, declaration) && is_pure(*conditional->whenTrue, declaration) &&
+        is_pure(*conditional->whenFalse, declaration);
+    }
+    if (auto call = dynamic_cast<const CallExpression *>(&expression)) {
+      // The callee has to stay the same function, so it's an unassigned global
+      auto callee = dynamic_cast<const Identifier *>(call->expression.get());
+      if (!callee || is_local(callee->text, declaration) || !is_pure(*callee, declaration) ||
+          !is_pure_function(*chain_.lookup_value(callee->text))) {
+        return false;
+      }
+      for (const auto &argument : call->arguments) {
+        if (!is_pure(*argument, declaration)) {
+          return false;
+        }
+      }
+      return true;
+    }
+    // Property access, new and yield
+    return false;
+  }
+};
+
+// Program cache
+//
+// A parsed program is immutable apart from lazily parsed bodies and the
+// interpreter's caches, which are safe to share (see FunctionBody and
+// Identifier). So contexts loading the same script, on any thread, share
+// one copy of its AST and compiled loops; closures, scopes, values and type
+// feedback (see Feedback) stay in each context. Programs are looked up by a hash of the file name
+// and source, and dropped with the last context using them.
+class ProgramCache {
+public:
+  static ProgramCache &shared() {
+    static ProgramCache cache;
+    return cache;
+  }
+  
+  std::shared_ptr<const SourceFile> load(const std::string &source, const std::string &file_name) {
+    auto key = std::hash<std::string>{}(file_name) ^ (std::hash<std::string>{}(source) * 31);
+    if (auto program = find(key, source, file_name)) {
+      return program;
+    }
+    
+    // Parsed without the lock, if two threads race the first one wins
+    auto text = std::make_shared<const std::string>(source);
+    auto program = std::make_shared<const SourceFile>(Parser(text).parse_source_file(file_name));
+    
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (auto existing = find_locked(key, source, file_name)) {
+      return existing;
+    }
+    prune_locked();
+    entries_.insert({key, Entry{text, file_name, program}});
+    return program;
+  }
+  
+  // Programs still in use
+  std::size_t size() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    prune_locked();
+    return entries_.size();
+  }
+  
+private:
+  struct Entry {
+    std::shared_ptr<const std::string> source;
+    std::string file_name;
+    std::weak_ptr<const SourceFile> program;
+  };
+  
+  std::mutex mutex_;
+  std::multimap<std::size_t, Entry> entries_;
+  
+  std::shared_ptr<const SourceFile> find(std::size_t key, const std::string &source, const std::string &file_name) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return find_locked(key, source, file_name);
+  }
+  
+  std::shared_ptr<const SourceFile> find_locked(std::size_t key, const std::string &source, const std::string &file_name) {
+    auto range = entries_.equal_range(key);
+    for (auto it = range.first; it != range.second; ++it) {
+      if (it->second.file_name == file_name && *it->second.source == source) {
+        if (auto program = it->second.program.lock()) {
+          return program;
+        }
+      }
+    }
+    return nullptr;
+  }
+  
+  void prune_locked() {
+    for (auto it = entries_.begin(); it != entries_.end();) {
+      it = it->second.program.expired() ? entries_.erase(it) : std::next(it);
+    }
+  }
+};
+
+// Embedding API
+//
+// A Context is one script loaded into its own globals, console, event loop,
+// heap and execution budget. Top-level code runs once in load; after that the host gets
+// handles to the script's functions and calls them as often as it likes.
+class Context;
+
+class FunctionHandle {
+public:
+  FunctionHandle(Context &context, std::shared_ptr<JSValue> function) : context_(context), function_(function) {};
+  
+  explicit operator bool() const { return function_ && function_->type == JSType::Function; }
+  
+  // Arguments are doubles, bools, strings or JS values. The result is a JS
+  // value unless asked for as double, bool or std::string.
+  template <typename Result = std::shared_ptr<JSValue>, typename... Arguments>
+  Result call(const Arguments &... arguments);
+  
+private:
+  Context &context_;
+  std::shared_ptr<JSValue> function_;
+};
+
+class Context {
+public:
+  Context(std::ostream &output = std::cout) : heap_(Heap::create()), console_(output) {
+    Enter enter(*this);
+    auto builtins = Heap::make<Scope>();
+    console_.install(*builtins);
+    event_loop_.install(*builtins);
+    builtins_ = builtins;
+    chain_.builtins = builtins_;
+    chain_.scope = Heap::make<Scope>();
+    chain_.global = chain_.scope.get();
+    chain_.feedback = &feedback_;
+  }
+  
+  Context(const Context &) = delete;
+  
+  // Breaks the cycles between scopes and the closures stored in them, so the
+  // script's memory is freed with the Context
+  ~Context() {
+    Enter enter(*this);
+    // A cached result can be the function itself
+    for (const auto &[name, function] : memoized_) {
+      function->memo.reset();
+    }
+    heap_->clear_scopes();
+    chain_.scope->cells.clear();
+    chain_.scope->values.clear();
+    builtins_->values.clear();
+    heap_->release();
+  }
+  
+  // Host functions are globals like the built-ins, but a script can
+  // shadow them. Register them before loading the scripts that use them.
+  void define(const std::string &name, FastNativeFunction function, void *data = nullptr) {
+    Enter enter(*this);
+    builtins_->values[name] = Heap::make<JSNativeFunction>(name, function, data);
+  }
+  
+  void define(const std::string &name, NativeFunction function) {
+    Enter enter(*this);
+    builtins_->values[name] = Heap::make<JSNativeFunction>(name, function);
+  }
+  
+  void load(const SourceFile &source_file) {
+    load(std::make_shared<const SourceFile>(source_file));
+  }
+  
+  // Parsed once per process, see ProgramCache
+  void load(const std::string &source, const std::string &file_name) {
+    load(ProgramCache::shared().load(source, file_name));
+  }
+  
+  void load(std::shared_ptr<const SourceFile> program) {
+    Enter enter(*this);
+    programs_.push_back(program);
+    chain_.load(*program);
+    check_memoized();
+  }
+  
+  struct ReloadResult {
+    std::vector<std::string> changed;
+    std::vector<std::string> unchanged;
+  };
+  
+  // Loads a new version of a loaded script, keeping the warm state of the
+  // functions that didn't change. Top-level functions are matched by name:
+  // an unchanged one keeps its parsed body, feedback and compiled loops,
+  // a changed or new one is re-evaluated into its global. Of the other
+  // top-level statements only new lets run. Functions gone from the new
+  // version stay defined, closures made before keep their old code. A script
+  // that wasn't loaded yet is loaded, with all its functions changed.
+  ReloadResult reload(const std::string &source, const std::string &file_name) {
+    auto loaded = std::find_if(programs_.rbegin(), programs_.rend(), [&](const auto &program) {
+      return program->fileName == file_name;
+    });
+    if (loaded == programs_.rend()) {
+      auto program = ProgramCache::shared().load(source, file_name);
+      load(program);
+      // Every function is new
+      ReloadResult result;
+      for (const auto &statement : program->statements) {
+        if (statement->getKind() == StatementKind::FunctionDeclaration) {
+          result.changed.push_back(static_cast<const FunctionDeclaration &>(*statement).name.text);
+        }
+      }
+      return result;
+    }
+    
+    Enter enter(*this);
+    auto program = ProgramCache::shared().load(source, file_name);
+    std::map<std::string, std::shared_ptr<Statement>> old_functions;
+    for (const auto &statement : (*loaded)->statements) {
+      if (statement->getKind() == StatementKind::FunctionDeclaration) {
+        old_functions[static_cast<const FunctionDeclaration &>(*statement).name.text] = statement;
+      }
+    }
+    
+    // A copy, the program itself is shared through the cache
+    auto merged = std::make_shared<SourceFile>(*program);
+    ReloadResult result;
+    for (auto &statement : merged->statements) {
+      if (statement->getKind() == StatementKind::FunctionDeclaration) {
+        auto &function = static_cast<const FunctionDeclaration &>(*statement);
+        auto old_function = old_functions.find(function.name.text);
+        if (old_function != old_functions.end() &&
+            static_cast<const FunctionDeclaration &>(*old_function->second).has_same_code(function)) {
+          statement = old_function->second;
+          result.unchanged.push_back(function.name.text);
+        } else {
+          // Same entry in the global scope, so its cells stay valid
+          function.evaluate(chain_);
+          result.changed.push_back(function.name.text);
+        }
+      } else if (statement->getKind() == StatementKind::VariableStatement) {
+        for (const auto &declaration : static_cast<const VariableStatement &>(*statement).declarationList_.declarations) {
+          if (!chain_.scope->values.count(declaration.name.text)) {
+            chain_.set_value(declaration.name.text, declaration.initializer->evaluate(chain_));
+          }
+        }
+      }
+    }
+    
+    *loaded = merged;
+    
+    // A changed function stays memoized under its name if it's still pure
+    for (auto &[name, function] : memoized_) {
+      auto value = chain_.lookup_value(name);
+      if (value != function && typeid(*value) == typeid(JSFunction)) {
+        auto reloaded = std::static_pointer_cast<JSFunction>(value);
+        reloaded->memo = Heap::make<MemoCache>(function->memo->capacity);
+        function->memo.reset();
+        function = reloaded;
+      }
+    }
+    check_memoized();
+    return result;
+  }
+  
+  // Caches the results of a global function by its arguments, if
+  // PurityAnalysis proves the function pure against the loaded scripts.
+  // Returns whether it did. Calls with arguments that aren't primitives
+  // still run the function.
+  bool memoize(const std::string &name, std::size_t capacity = 1024) {
+    Enter enter(*this);
+    auto value = chain_.lookup_value(name);
+    if (!PurityAnalysis(chain_, programs_).is_pure(*value)) {
+      return false;
+    }
+    auto function = std::static_pointer_cast<JSFunction>(value);
+    if (!function->memo) {
+      function->memo = Heap::make<MemoCache>(capacity);
+    }
+    memoized_[name] = function;
+    return true;
+  }
+  
+  // Empty if the function isn't memoized
+  std::optional<MemoCache::Statistics> memo_statistics(const std::string &name) const {
+    auto it = memoized_.find(name);
+    if (it == memoized_.end()) {
+      return std::nullopt;
+    }
+    return it->second->memo->statistics();
+  }
+  
+  // Empty handle if there is no such global function
+  FunctionHandle function(const std::string &name) {
+    auto value = chain_.lookup_value(name);
+    if (!value || value->type != JSType::Function) {
+      return FunctionHandle(*this, nullptr);
+    }
+    return FunctionHandle(*this, value);
+  }
+  
+  // Runs queued jobs and timers until there are none left
+  void run() {
+    Enter enter(*this);
+    event_loop_.run(chain_);
+    console_.flush();
+  }
+  
+  // Allocations that would go over the hard limit throw OutOfMemoryError,
+  // going over the soft limit calls the near heap limit callback. Zero means
+  // no limit.
+  void set_heap_limits(std::size_t soft_limit, std::size_t hard_limit) {
+    heap_->soft_limit = soft_limit;
+    heap_->hard_limit = hard_limit;
+  }
+  
+  void set_near_heap_limit_callback(Heap::NearHeapLimitCallback callback) {
+    heap_->near_heap_limit_callback = callback;
+  }
+  
+  Heap::Statistics heap_statistics() {
+    return heap_->statistics();
+  }
+  
+  // Frees unreachable closures now rather than when the heap fills up
+  std::size_t collect_garbage() {
+    Enter enter(*this);
+    return heap_->collect();
+  }
+  
+  // Fuel for each call into the script, Execution::kUnlimited by default.
+  // Running out throws TerminationError.
+  void set_fuel_limit(int64_t fuel_limit) {
+    execution_.fuel_limit = fuel_limit;
+  }
+  
+  // Terminates the running script, safe to call from any thread
+  void interrupt() {
+    execution_.interrupt();
+  }
+  
+  // Makes the context current while the script runs
+  class Enter {
+  public:
+    Enter(Context &context) : heap_(context.heap_), execution_(&context.execution_), frames_(&context.frames_) {};
+    
+  private:
+    Heap::Enter heap_;
+    Execution::Enter execution_;
+    FrameStack::Enter frames_;
+  };
+  
+  Chain &chain() { return chain_; }
+  
+private:
+  // Released, not deleted: values allocated from it may outlive the Context
+  Heap *heap_;
+  Execution execution_;
+  FrameStack frames_ {heap_};
+  Console console_;
+  EventLoop event_loop_;
+  std::shared_ptr<Scope> builtins_;
+  Feedback feedback_ {heap_};
+  Chain chain_;
+  std::vector<std::shared_ptr<const SourceFile>> programs_;
+  std::map<std::string, std::shared_ptr<JSFunction>> memoized_;
+  
+  // Code loaded since memoize may assign what a memoized function reads, or
+  // define another function under a name it calls. A function that isn't
+  // provably pure anymore, or whose global now holds another function, stops
+  // being memoized; the others start over with empty caches.
+  void check_memoized() {
+    if (memoized_.empty()) {
+      return;
+    }
+    PurityAnalysis analysis(chain_, programs_);
+    for (auto it = memoized_.begin(); it != memoized_.end();) {
+      const auto &function = it->second;
+      if (chain_.lookup_value(it->first) != function || !analysis.is_pure(*function)) {
+        function->memo.reset();
+        it = memoized_.erase(it);
+      } else {
+        function->memo->clear();
+        ++it;
+      }
+    }
+  }
+};
+
+std::shared_ptr<JSValue> to_js_value(double value) { return Heap::make<JSNumber>(value); }
+std::shared_ptr<JSValue> to_js_value(int value) { return Heap::make<JSNumber>(value); }
+std::shared_ptr<JSValue> to_js_value(bool value) { return JSBoolean::from(value); }
+std::shared_ptr<JSValue> to_js_value(const std::string &value) { return Heap::make<JSString>(value); }
+std::shared_ptr<JSValue> to_js_value(const char *value) { return Heap::make<JSString>(value); }
+std::shared_ptr<JSValue> to_js_value(const std::shared_ptr<JSValue> &value) { return value; }
+
+template <typename Result>
+Result from_js_value(const std::shared_ptr<JSValue> &value) {
+  if constexpr (std::is_same_v<Result, double>) {
+    return value->type == JSType::Number ? static_cast<const JSNumber &>(*value).value : value->as_number()->value;
+  } else if constexpr (std::is_same_v<Result, bool>) {
+    return is_truthy(value);
+  } else if constexpr (std::is_same_v<Result, std::string>) {
+    return value->type == JSType::String ? static_cast<const JSString &>(*value).value : value->serialize();
+  } else {
+    return value;
+  }
+}
+
+template <typename Result, typename... Arguments>
+Result FunctionHandle::call(const Arguments &... arguments) {
+  if (!*this) {
+    throw std::runtime_error("TypeError: not a function");
+  }
+  Context::Enter enter(context_);
+  auto value = function_->call(context_.chain(), { to_js_value(arguments)... });
+  return from_js_value<Result>(value);
+}
+
+// see js/fib.js
+SourceFile createFibonacciProgram() {
+  // fib
+  auto identifier_fib = Identifier{"fib"};
+  auto parameter_n = Parameter{Identifier{"n"}};
+  
+  auto first_if_block = Block({ std::make_shared<ReturnStatement>(std::make_shared<NumericLiteral>("1")) });
+  auto first_if_condition = BinaryExpression { std::make_shared<Identifier>("n"), Token::EqualsEqualsEquals, std::make_shared<NumericLiteral>("1") };
+  
+  auto second_if_block = Block({ std::make_shared<ReturnStatement>(std::make_shared<NumericLiteral>("1")) });
+  auto second_if_condition = BinaryExpression { std::make_shared<Identifier>("n"), Token::EqualsEqualsEquals, std::make_shared<NumericLiteral>("2") };
+  
+  std::vector<std::shared_ptr<Expression>> fib_arguments_left {
+    std::make_shared<BinaryExpression>(std::make_shared<Identifier>("n"), Token::Minus, std::make_shared<NumericLiteral>("1"))
+  };
+  auto binary_left = std::make_shared<CallExpression>(std::make_shared<Identifier>("fib"), fib_arguments_left);
+  
+  std::vector<std::shared_ptr<Expression>> fib_arguments_right {
+    std::make_shared<BinaryExpression>(std::make_shared<Identifier>("n"), Token::Minus, std::make_shared<NumericLiteral>("2"))
+  };
+  auto binary_right = std::make_shared<CallExpression>(std::make_shared<Identifier>("fib"), fib_arguments_right);
+  
+  auto sum = std::make_shared<BinaryExpression>(binary_left, Token::Plus, binary_right);
+  
+  auto function_declaration_fib = FunctionDeclaration {
+    identifier_fib,
+    Block({
+      std::make_shared<IfStatement>(first_if_condition, first_if_block),
+      std::make_shared<IfStatement>(second_if_condition, second_if_block),
+      std::make_shared<ReturnStatement>(sum),
+    }),
+    {parameter_n}
+  };
+  
+  // main
+  auto identifier_main = Identifier{"main"};
+  std::vector<std::shared_ptr<Expression>> args = {std::make_shared<NumericLiteral>("25")};
+  auto ce = std::make_shared<CallExpression>(std::make_shared<Identifier>("fib"), args);
+  auto function_declaration_main = FunctionDeclaration {
+    identifier_main,
+    Block({ std::make_shared<ReturnStatement>(ce) }),
+    {}
+  };
+  
+  auto source_file = SourceFile{ "./js/fib.js" };
+  source_file.statements.push_back(std::make_shared<FunctionDeclaration>(function_declaration_fib));
+  source_file.statements.push_back(std::make_shared<FunctionDeclaration>(function_declaration_main));
+  
+  return source_file;
+}
+
+// see js/let.js
+SourceFile createLetProgram() {
+  auto source_file = SourceFile{ "./js/let.js" };
+  
+  auto let_a = std::make_shared<VariableStatement>(VariableDeclarationList {{
+    VariableDeclaration { Identifier { "a" }, std::make_shared<NumericLiteral>("1") }
+  }});
+  source_file.statements.push_back(let_a);
+  
+  auto let_b = std::make_shared<VariableStatement>(VariableDeclarationList {{
+    VariableDeclaration { Identifier { "b" }, std::make_shared<NumericLiteral>("2") }
+  }});
+  source_file.statements.push_back(let_b);
+  
+  auto function_declaration_main = FunctionDeclaration {
+    Identifier { "main" },
+    Block({ std::make_shared<ReturnStatement>(std::make_shared<BinaryExpression>(std::make_shared<Identifier>("a"), Token::Plus, std::make_shared<Identifier>("b"))) }),
+    {}
+  };
+  source_file.statements.push_back(std::make_shared<FunctionDeclaration>(function_declaration_main));
+  
+  return source_file;
+}
+
+// see js/closure.js
+SourceFile createClosureProgram() {
+  auto source_file = SourceFile{ "./js/closure.js" };
+  
+  // inner
+  auto function_declaration_inner = FunctionDeclaration {
+    Identifier { "inner" },
+    Block({
+      std::make_shared<ReturnStatement>(std::make_shared<BinaryExpression>(std::make_shared<Identifier>("a"), Token::Plus, std::make_shared<Identifier>("b")))
+    }),
+    {
+      Parameter{ Identifier{ "b" } }
+    }
+  };
+  
+  // sum
+  auto function_declaration_sum = FunctionDeclaration {
+    Identifier { "sum" },
+    Block({
+      std::make_shared<FunctionDeclaration>(function_declaration_inner),
+      std::make_shared<ReturnStatement>(std::make_shared<Identifier>("inner"))
+    }),
+    {
+      Parameter{ Identifier{ "a" } }
+    }
+  };
+  source_file.statements.push_back(std::make_shared<FunctionDeclaration>(function_declaration_sum));
+  
+  // main
+  std::vector<std::shared_ptr<Expression>> args_inner = {std::make_shared<NumericLiteral>("40")};
+  auto call_expression_inner = std::make_shared<CallExpression>(std::make_shared<Identifier>("sum"), args_inner);
+  
+  std::vector<std::shared_ptr<Expression>> args_outer = {std::make_shared<NumericLiteral>("2")};
+  auto call_expression_outer = std::make_shared<CallExpression>(call_expression_inner, args_outer);
+  
+  auto function_declaration_main = FunctionDeclaration {
+    Identifier { "main" },
+    Block({ std::make_shared<ReturnStatement>(call_expression_outer) }),
+    {}
+  };
+  source_file.statements.push_back(std::make_shared<FunctionDeclaration>(function_declaration_main));
+  
+  return source_file;
+}
+
+// see js/list.js
+SourceFile createListProgram() {
+  auto source_file = SourceFile{ "./js/list.js" };
+  
+  // inner
+  std::vector<std::shared_ptr<Expression>> args_getter = {
+    std::make_shared<Identifier>("a"),
+    std::make_shared<Identifier>("b")
+  };
+  auto function_declaration_inner = FunctionDeclaration {
+    Identifier { "inner" },
+    Block({
+      std::make_shared<ReturnStatement>(std::make_shared<CallExpression>(std::make_shared<Identifier>("getter"), args_getter))
+    }),
+    {
+      Parameter{ Identifier{ "getter" } }
+    }
+  };
+  // pair
+  auto function_declaration_pair = FunctionDeclaration {
+    Identifier { "pair" },
+    Block({
+      std::make_shared<FunctionDeclaration>(function_declaration_inner),
+      std::make_shared<ReturnStatement>(std::make_shared<Identifier>("inner"))
+    }),
+    {
+      Parameter{ Identifier{ "a" } },
+      Parameter{ Identifier{ "b" } }
+    }
+  };
+  source_file.statements.push_back(std::make_shared<FunctionDeclaration>(function_declaration_pair));
+  
+  // getFirst
+  auto function_declaration_getFirst = FunctionDeclaration {
+    Identifier { "getFirst" },
+    Block({
+      std::make_shared<ReturnStatement>(std::make_shared<Identifier>("a"))
+    }),
+    {
+      Parameter{ Identifier{ "a" } },
+      Parameter{ Identifier{ "b" } }
+    }
+  };
+  // first
+  std::vector<std::shared_ptr<Expression>> args_pair = {
+    std::make_shared<Identifier>("getFirst")
+  };
+  auto function_declaration_first = FunctionDeclaration {
+    Identifier { "first" },
+    Block({
+      std::make_shared<FunctionDeclaration>(function_declaration_getFirst),
+      std::make_shared<ReturnStatement>(std::make_shared<CallExpression>(std::make_shared<Identifier>("pair"), args_pair))
+    }),
+    {
+      Parameter{ Identifier{ "pair" } }
+    }
+  };
+  source_file.statements.push_back(std::make_shared<FunctionDeclaration>(function_declaration_first));
+  
+  // getSecond
+  auto function_declaration_getSecond = FunctionDeclaration {
+    Identifier { "getSecond" },
+    Block({
+      std::make_shared<ReturnStatement>(std::make_shared<Identifier>("b"))
+    }),
+    {
+      Parameter{ Identifier{ "a" } },
+      Parameter{ Identifier{ "b" } }
+    }
+  };
+  // second
+  std::vector<std::shared_ptr<Expression>> args_pair_2 = {
+    std::make_shared<Identifier>("getSecond")
+  };
+  auto function_declaration_second = FunctionDeclaration {
+    Identifier { "second" },
+    Block({
+      std::make_shared<FunctionDeclaration>(function_declaration_getSecond),
+      std::make_shared<ReturnStatement>(std::make_shared<CallExpression>(std::make_shared<Identifier>("pair"), args_pair_2))
+    }),
+    {
+      Parameter{ Identifier{ "pair" } }
+    }
+  };
+  source_file.statements.push_back(std::make_shared<FunctionDeclaration>(function_declaration_second));
+  
+  // sum
+  auto first_if_condition = BinaryExpression { std::make_shared<Identifier>("list"), Token::EqualsEqualsEquals, std::make_shared<Identifier>("undefined") };
+  auto first_if_block = Block({ std::make_shared<ReturnStatement>(std::make_shared<NumericLiteral>("0")) });
+  
+  std::vector<std::shared_ptr<Expression>> left_args = {
+    std::make_shared<Identifier>("list")
+  };
+  auto left = std::make_shared<CallExpression>(std::make_shared<Identifier>("first"), left_args);
+  
+  
+  std::vector<std::shared_ptr<Expression>> right_inner_args = {
+    std::make_shared<Identifier>("list")
+  };
+  auto right_inner = std::make_shared<CallExpression>(std::make_shared<Identifier>("second"), left_args);
+  std::vector<std::shared_ptr<Expression>> right_args = {
+    right_inner
+  };
+  auto right = std::make_shared<CallExpression>(std::make_shared<Identifier>("sum"), right_args);
+  
+  auto function_declaration_sum = FunctionDeclaration {
+    Identifier { "sum" },
+    Block({
+      std::make_shared<IfStatement>(first_if_condition, first_if_block),
+      std::make_shared<ReturnStatement>(std::make_shared<BinaryExpression>(left, Token::Plus, right))
+    }),
+    {
+      Parameter{ Identifier{ "list" } }
+    }
+  };
+  source_file.statements.push_back(std::make_shared<FunctionDeclaration>(function_declaration_sum));
+  
+  // main
+  std::vector<std::shared_ptr<Expression>> pair_4_args = {
+    std::make_shared<NumericLiteral>("4"),
+  };
+  
+  std::vector<std::shared_ptr<Expression>> pair_3_args = {
+    std::make_shared<NumericLiteral>("3"),
+    std::make_shared<CallExpression>(std::make_shared<Identifier>("pair"), pair_4_args)
+  };
+  
+  std::vector<std::shared_ptr<Expression>> pair_2_args = {
+    std::make_shared<NumericLiteral>("2"),
+    std::make_shared<CallExpression>(std::make_shared<Identifier>("pair"), pair_3_args)
+  };
+  
+  std::vector<std::shared_ptr<Expression>> pair_1_args = {
+    std::make_shared<NumericLiteral>("1"),
+    std::make_shared<CallExpression>(std::make_shared<Identifier>("pair"), pair_2_args)
+  };
+  std::vector<std::shared_ptr<Expression>> pair_1 = {std::make_shared<CallExpression>(std::make_shared<Identifier>("pair"), pair_1_args)};
+  
+  auto call_expression_first = std::make_shared<CallExpression>(std::make_shared<Identifier>("sum"), pair_1);
+  
+  auto function_declaration_main = FunctionDeclaration {
+    Identifier { "main" },
+    Block({ std::make_shared<ReturnStatement>(call_expression_first) }),
+    {}
+  };
+  source_file.statements.push_back(std::make_shared<FunctionDeclaration>(function_declaration_main));
+  
+  return source_file;
+}
+
+// see js/loop.js
+SourceFile createLoopProgram() {
+  auto source_file = SourceFile{ "./js/loop.js" };
+  
+  // for (let i = 0; i < 100000; i = i + 1) { ... }
+  auto let_i = std::make_shared<VariableStatement>(VariableDeclarationList {{
+    VariableDeclaration { Identifier { "i" }, std::make_shared<NumericLiteral>("0") }
+  }});
+  auto for_condition = std::make_shared<BinaryExpression>(std::make_shared<Identifier>("i"), Token::LessThan, std::make_shared<NumericLiteral>("100000"));
+  auto for_incrementor = std::make_shared<BinaryExpression>(std::make_shared<Identifier>("i"), Token::Equals, std::make_shared<BinaryExpression>(std::make_shared<Identifier>("i"), Token::Plus, std::make_shared<NumericLiteral>("1")));
+  
+  auto if_condition = BinaryExpression { std::make_shared<Identifier>("odd"), Token::EqualsEqualsEquals, std::make_shared<NumericLiteral>("1") };
+  auto if_block = Block({
+    std::make_shared<ExpressionStatement>(std::make_shared<BinaryExpression>(std::make_shared<Identifier>("total"), Token::Equals, std::make_shared<BinaryExpression>(std::make_shared<Identifier>("total"), Token::Plus, std::make_shared<Identifier>("i"))))
+  });
+  auto for_statement = std::make_shared<ForStatement>(let_i, for_condition, for_incrementor, Block({
+    std::make_shared<IfStatement>(if_condition, if_block),
+    std::make_shared<ExpressionStatement>(std::make_shared<BinaryExpression>(std::make_shared<Identifier>("odd"), Token::Equals, std::make_shared<BinaryExpression>(std::make_shared<NumericLiteral>("1"), Token::Minus, std::make_shared<Identifier>("odd"))))
+  }));
+  
+  // while (n < 10) { ... }
+  auto while_condition = std::make_shared<BinaryExpression>(std::make_shared<Identifier>("n"), Token::LessThan, std::make_shared<NumericLiteral>("10"));
+  auto while_statement = std::make_shared<WhileStatement>(while_condition, Block({
+    std::make_shared<ExpressionStatement>(std::make_shared<BinaryExpression>(std::make_shared<Identifier>("n"), Token::Equals, std::make_shared<BinaryExpression>(std::make_shared<Identifier>("n"), Token::Plus, std::make_shared<NumericLiteral>("1"))))
+  }));
+  
+  auto function_declaration_main = FunctionDeclaration {
+    Identifier { "main" },
+    Block({
+      std::make_shared<VariableStatement>(VariableDeclarationList {{
+        VariableDeclaration { Identifier { "total" }, std::make_shared<NumericLiteral>("0") },
+        VariableDeclaration { Identifier { "odd" }, std::make_shared<NumericLiteral>("0") },
+        VariableDeclaration { Identifier { "n" }, std::make_shared<NumericLiteral>("0") }
+      }}),
+      for_statement,
+      while_statement,
+      std::make_shared<ReturnStatement>(std::make_shared<BinaryExpression>(std::make_shared<Identifier>("total"), Token::Plus, std::make_shared<Identifier>("n")))
+    }),
+    {}
+  };
+  source_file.statements.push_back(std::make_shared<FunctionDeclaration>(function_declaration_main));
+  
+  return source_file;
+}
+
+// see js/async.js
+SourceFile createAsyncProgram() {
+  auto source_file = SourceFile{ "./js/async.js" };
+  
+  // start
+  std::vector<std::shared_ptr<Expression>> args_set_timeout = {
+    std::make_shared<Identifier>("resolve"),
+    std::make_shared<NumericLiteral>("10"),
+    std::make_shared<NumericLiteral>("40")
+  };
+  auto function_declaration_start = FunctionDeclaration {
+    Identifier { "start" },
+    Block({
+      std::make_shared<ExpressionStatement>(std::make_shared<CallExpression>(std::make_shared<Identifier>("setTimeout"), args_set_timeout))
+    }),
+    {
+      Parameter{ Identifier{ "resolve" } }
+    }
+  };
+  source_file.statements.push_back(std::make_shared<FunctionDeclaration>(function_declaration_start));
+  
+  // addOne
+  auto function_declaration_add_one = FunctionDeclaration {
+    Identifier { "addOne" },
+    Block({
+      std::make_shared<ReturnStatement>(std::make_shared<BinaryExpression>(std::make_shared<Identifier>("x"), Token::Plus, std::make_shared<NumericLiteral>("1")))
+    }),
+    {
+      Parameter{ Identifier{ "x" } }
+    }
+  };
+  source_file.statements.push_back(std::make_shared<FunctionDeclaration>(function_declaration_add_one));
+  
+  // later
+  std::vector<std::shared_ptr<Expression>> args_resolve = {
+    std::make_shared<BinaryExpression>(std::make_shared<Identifier>("x"), Token::Plus, std::make_shared<NumericLiteral>("1"))
+  };
+  auto promise_resolve = std::make_shared<PropertyAccessExpression>(std::make_shared<Identifier>("Promise"), Identifier { "resolve" });
+  auto function_declaration_later = FunctionDeclaration {
+    Identifier { "later" },
+    Block({
+      std::make_shared<ReturnStatement>(std::make_shared<CallExpression>(promise_resolve, args_resolve))
+    }),
+    {
+      Parameter{ Identifier{ "x" } }
+    }
+  };
+  source_file.statements.push_back(std::make_shared<FunctionDeclaration>(function_declaration_later));
+  
+  // main
+  std::vector<std::shared_ptr<Expression>> args_promise = { std::make_shared<Identifier>("start") };
+  auto new_promise = std::make_shared<NewExpression>(std::make_shared<Identifier>("Promise"), args_promise);
+  
+  std::vector<std::shared_ptr<Expression>> args_add_one = { std::make_shared<Identifier>("addOne") };
+  auto then_add_one = std::make_shared<CallExpression>(std::make_shared<PropertyAccessExpression>(new_promise, Identifier { "then" }), args_add_one);
+  
+  std::vector<std::shared_ptr<Expression>> args_later = { std::make_shared<Identifier>("later") };
+  auto then_later = std::make_shared<CallExpression>(std::make_shared<PropertyAccessExpression>(then_add_one, Identifier { "then" }), args_later);
+  
+  auto function_declaration_main = FunctionDeclaration {
+    Identifier { "main" },
+    Block({ std::make_shared<ReturnStatement>(then_later) }),
+    {}
+  };
+  source_file.statements.push_back(std::make_shared<FunctionDeclaration>(function_declaration_main));
+  
+  return source_file;
+}
+
+// see js/lazy.js
+SourceFile createLazyProgram() {
+  auto source = std::make_shared<const std::string>(R"(
+function unused(a, b) {
+  function helper(c) {
+    return a + b + c;
+  }
+  return helper;
+}
+
+function double(x) {
+  return x + x;
+}
+
+function main() {
+  let total = 0;
+  for (let i = 0; i < 10; i = i + 1) {
+    total = total + double(i);
+  }
+  return total;
+}
+)");
+  
+  return Parser(source).parse_source_file("./js/lazy.js");
+}
+
+// see js/console.js
+SourceFile createConsoleProgram() {
+  auto source = std::make_shared<const std::string>(R"(
+function main() {
+  console.log("hello", 'world');
+  console.log(1, 0.5, 0.1 + 0.2, 1 - 3, 123456789012345680000, 1e21, 0.000001, 0.0000001);
+  console.log(true, undefined);
+  return 42;
+}
+)");
+  
+  return Parser(source).parse_source_file("./js/console.js");
+}
+
+// see js/generator.js
+SourceFile createGeneratorProgram() {
+  auto source = std::make_shared<const std::string>(R"(
+function* naturals() {
+  let n = 0;
+  while (true) {
+    yield n;
+    n = n + 1;
+  }
+}
+
+function* take(source, count) {
+  for (let i = 0; i < count; i = i + 1) {
+    let step = source.next();
+    if (step.done === true) {
+      return;
+    }
+    yield step.value;
+  }
+}
+
+function* running() {
+  let total = 0;
+  while (true) {
+    let value = yield total;
+    total = total + value;
+  }
+}
+
+function main() {
+  let numbers = take(naturals(), 10);
+  let sum = running();
+  sum.next();
+  let total = 0;
+  let step = numbers.next();
+  while (step.done === false) {
+    total = sum.next(step.value).value;
+    step = numbers.next();
+  }
+  return total;
+}
+)");
+  
+  return Parser(source).parse_source_file("./js/generator.js");
+}
+
+std::shared_ptr<JSValue> createScopeAndEvaluate(SourceFile source_file, std::ostream &output = std::cout) {
+  Context context(output);
+  context.load(source_file);
+  
+  auto main_function = context.function("main");
+  if (!main_function) {
+    TRACE_LOG("No main function!");
+    return nullptr;
+  }
+  
+  auto value = main_function.call();
+  context.run();
+  
+  // A promise returned from main is awaited
+  if (auto promise = std::dynamic_pointer_cast<JSPromise>(value)) {
+    if (auto reason = promise->reason()) {
+      throw std::runtime_error("Uncaught (in promise) " + reason->serialize());
+    }
+    return promise->value();
+  }
+  return value;
+}
+
+int main(int argc, const char *argv[]) {
+  {
+    auto source_file = createFibonacciProgram();
+    auto value = createScopeAndEvaluate(source_file);
+    if (!value) {
+      return 1;
+    }
+    auto serialized_value = value->serialize();
+    std::cout << source_file.fileName << ": " << serialized_value << "\n";
+    assert(serialized_value == "75025");
+  }
+  
+  {
+    auto source_file = createLetProgram();
     auto value = createScopeAndEvaluate(source_file);
     if (!value) {
       return 1;
     }
-    auto serialized_value = value->serialize();
-    std::cout << source_file.fileName << ": " << serialized_value << std::endl;
-    assert(serialized_value == "10.000000");
+    auto serialized_value = value->serialize();
+    std::cout << source_file.fileName << ": " << serialized_value << "\n";
+    assert(serialized_value == "3");
+  }
+  
+  {
+    auto source_file = createClosureProgram();
+    auto value = createScopeAndEvaluate(source_file);
+    if (!value) {
+      return 1;
+    }
+    auto serialized_value = value->serialize();
+    std::cout << source_file.fileName << ": " << serialized_value << "\n";
+    assert(serialized_value == "42");
+  }
+  
+  {
+    auto source_file = createListProgram();
+    auto value = createScopeAndEvaluate(source_file);
+    if (!value) {
+      return 1;
+    }
+    auto serialized_value = value->serialize();
+    std::cout << source_file.fileName << ": " << serialized_value << "\n";
+    assert(serialized_value == "10");
+  }
+  
+  {
+    auto source_file = createLoopProgram();
+    auto value = createScopeAndEvaluate(source_file);
+    if (!value) {
+      return 1;
+    }
+    auto serialized_value = value->serialize();
+    std::cout << source_file.fileName << ": " << serialized_value << "\n";
+    assert(serialized_value == "2500000010");
+  }
+  
+  {
+    auto source_file = createAsyncProgram();
+    auto value = createScopeAndEvaluate(source_file);
+    if (!value) {
+      return 1;
+    }
+    auto serialized_value = value->serialize();
+    std::cout << source_file.fileName << ": " << serialized_value << "\n";
+    assert(serialized_value == "42");
+  }
+  
+  {
+    // Errors in reactions and executors reject promises instead of
+    // stopping the event loop
+    Context context;
+    context.load(R"(
+let okTotal = 0;
+let rejectedWith = 0;
+let caughtCount = 0;
+let reason = undefined;
+let notFunction = 1;
+
+function boom(value) {
+  return notFunction(value);
+}
+
+function ok(value) {
+  okTotal = okTotal + value;
+  return value;
+}
+
+function recover(error) {
+  reason = error;
+  return 7;
+}
+
+function fail(resolve, reject) {
+  reject(3);
+  return 0;
+}
+
+function rejected(value) {
+  rejectedWith = value;
+  return 0;
+}
+
+function caught(error) {
+  caughtCount = caughtCount + 1;
+  return 0;
+}
+
+function badExecutor(resolve, reject) {
+  return boom(0);
+}
+
+function main() {
+  let p = Promise.resolve(1);
+  p.then(boom).catch(recover).then(ok);
+  p.then(ok);
+  new Promise(fail).then(ok, rejected);
+  new Promise(badExecutor).catch(caught);
+  return p;
+}
+)", "reject.js");
+    
+    auto promise = context.function("main").call();
+    context.run();
+    auto global = [&](const std::string &name) {
+      return context.chain().lookup_value(name)->serialize();
+    };
+    auto ok_total = global("okTotal");
+    auto rejected_with = global("rejectedWith");
+    auto caught_count = global("caughtCount");
+    auto reason = global("reason");
+    // ok ran after the recovery too
+    assert(ok_total == "8");
+    assert(rejected_with == "3");
+    assert(caught_count == "1");
+    assert(reason == "1 is not a function");
+    
+    // Bound methods are made once per promise
+    auto then = promise->get_property("then");
+    auto then_again = promise->get_property("then");
+    auto catch_method = promise->get_property("catch");
+    assert(then == then_again);
+    assert(then != catch_method);
+    promise.reset();
+    auto chained = then->call(context.chain(), {});
+    assert(std::dynamic_pointer_cast<JSPromise>(chained));
+  }
+  
+  {
+    // A timer that throws doesn't lose the ones that expired with it
+    Context context;
+    context.load(R"(
+let fired = 0;
+
+function first() {
+  fired = fired + 1;
+  return 0;
+}
+
+function second() {
+  return undefinedName();
+}
+
+function third() {
+  fired = fired + 10;
+  return 0;
+}
+
+function main() {
+  setTimeout(first, 5);
+  setTimeout(second, 5);
+  setTimeout(third, 5);
+  return 0;
+}
+)", "timers.js");
+    
+    context.function("main").call();
+    [[maybe_unused]] bool threw = false;
+    try {
+      context.run();
+    } catch (const std::runtime_error &) {
+      threw = true;
+    }
+    auto fired = context.chain().lookup_value("fired")->serialize();
+    assert(threw);
+    assert(fired == "1");
+    context.run();
+    fired = context.chain().lookup_value("fired")->serialize();
+    assert(fired == "11");
+  }
+  
+  {
+    auto source_file = createLazyProgram();
+    auto value = createScopeAndEvaluate(source_file);
+    if (!value) {
+      return 1;
+    }
+    auto serialized_value = value->serialize();
+    std::cout << source_file.fileName << ": " << serialized_value << "\n";
+    assert(serialized_value == "90");
+    
+    // Functions that never ran were only preparsed
+    auto is_compiled = [&](std::size_t index) {
+      return std::static_pointer_cast<FunctionDeclaration>(source_file.statements.at(index))->is_compiled();
+    };
+    [[maybe_unused]] auto compiled = std::vector<bool> {is_compiled(0), is_compiled(1), is_compiled(2)};
+    assert(compiled == std::vector<bool>({false, true, true}));
+  }
+  
+  {
+    auto source_file = createConsoleProgram();
+    std::ostringstream output;
+    auto value = createScopeAndEvaluate(source_file, output);
+    if (!value) {
+      return 1;
+    }
+    auto serialized_value = value->serialize();
+    std::cout << source_file.fileName << ": " << serialized_value << "\n";
+    assert(serialized_value == "42");
+    assert(output.str() ==
+           "hello world\n"
+           "1 0.5 0.30000000000000004 -2 123456789012345680000 1e+21 0.000001 1e-7\n"
+           "true undefined\n");
+  }
+  
+  {
+    // Malformed numbers and stray bytes are syntax errors
+    for (auto source : {"let x = 1.2.3;", "let x = 1e;", "let x = 12abc;", "let x = \xc3\xa9;"}) {
+      [[maybe_unused]] bool threw = false;
+      try {
+        Parser(std::make_shared<const std::string>(source)).parse_source_file("invalid.js");
+      } catch (const std::runtime_error &error) {
+        threw = std::string(error.what()).find("SyntaxError") == 0;
+      }
+      assert(threw);
+    }
+    
+    Context context;
+    context.load("let x = 1.5e2; let y = 0.25; let z = '\xc3\xa9'; // \xc3\xa9", "numbers.js");
+    auto x = context.chain().lookup_value("x")->serialize();
+    auto y = context.chain().lookup_value("y")->serialize();
+    auto z = context.chain().lookup_value("z")->serialize();
+    assert(x == "150");
+    assert(y == "0.25");
+    assert(z == "\xc3\xa9");
+  }
+  
+  {
+    auto source_file = createGeneratorProgram();
+    auto value = createScopeAndEvaluate(source_file);
+    if (!value) {
+      return 1;
+    }
+    auto serialized_value = value->serialize();
+    std::cout << source_file.fileName << ": " << serialized_value << "\n";
+    assert(serialized_value == "45");
+  }
+#if NOTJS_TRACE_LEVEL >= 1
+  {
+    // Tracing the calls of js/lazy.js, through the binary dump and decoder
+    Trace::clear();
+    Trace::enable();
+    auto source_file = createLazyProgram();
+    auto value = createScopeAndEvaluate(source_file);
+    Trace::disable();
+    if (!value) {
+      return 1;
+    }
+    auto serialized_value = value->serialize();
+    assert(serialized_value == "90");
+    
+    std::stringstream trace;
+    Trace::dump(trace);
+    std::ostringstream decoded;
+    Trace::decode(trace, decoded);
+    
+    auto count = [&](const std::string &needle) {
+      std::size_t result = 0;
+      for (auto at = decoded.str().find(needle); at != std::string::npos; at = decoded.str().find(needle, at + 1)) {
+        ++result;
+      }
+      return result;
+    };
+    [[maybe_unused]] auto counts = std::vector<std::size_t> {
+      count("call double (1 argument(s))"),
+      count("return double"),
+      count("call main"),
+      count("lookup x (frame)"),
+      count("lookup double (global)"),
+      count("allocate JSFunction"),
+    };
+    // Only the first call is real, the others are inlined
+    assert(counts == std::vector<std::size_t>({1, 1, 1, 20, 10, 3}));
+  }
+  
+  {
+    // Contexts sharing a program keep their own feedback: another context
+    // deoptimizing a call site doesn't stop this one from inlining
+    auto source = R"(
+function getX(a, b) {
+  return a;
+}
+
+function getY(a, b) {
+  return b;
+}
+
+function apply(f, a, b) {
+  return f(a, b);
+}
+)";
+    Context first;
+    Context second;
+    first.load(source, "feedback.js");
+    second.load(source, "feedback.js");
+    
+    auto get_x = first.chain().lookup_value("getX");
+    for (int i = 0; i != 3; ++i) {
+      [[maybe_unused]] auto x = first.function("apply").call<double>(get_x, 1, 2);
+      assert(x == 1);
+    }
+    [[maybe_unused]] auto y = second.function("apply").call<double>(second.chain().lookup_value("getY"), 1, 2);
+    assert(y == 2);
+    
+    auto calls_to_get_x = [&](Context &context) {
+      Trace::clear();
+      Trace::enable();
+      auto get_x = context.chain().lookup_value("getX");
+      [[maybe_unused]] auto x = context.function("apply").call<double>(get_x, 1, 2);
+      Trace::disable();
+      assert(x == 1);
+      
+      std::stringstream trace;
+      Trace::dump(trace);
+      std::ostringstream decoded;
+      Trace::decode(trace, decoded);
+      return decoded.str().find("call getX") != std::string::npos;
+    };
+    [[maybe_unused]] auto first_calls = calls_to_get_x(first);
+    [[maybe_unused]] auto second_calls = calls_to_get_x(second);
+    assert(!first_calls);
+    assert(second_calls);
+  }
+  
+  {
+    // A call that throws still records its return, and a call the depth
+    // check refuses records nothing
+    Context context;
+    context.load(R"(
+function fail(n) {
+  return undefinedName(n);
+}
+
+function down(n) {
+  return down(n + 1);
+}
+
+function after(n) {
+  return n;
+}
+)", "unbalanced.js");
+    
+    Trace::clear();
+    Trace::enable();
+    [[maybe_unused]] auto threw = 0;
+    for (const auto &name : {"fail", "down"}) {
+      try {
+        context.function(name).call<double>(1);
+      } catch (const std::exception &) {
+        ++threw;
+      }
+    }
+    [[maybe_unused]] auto result = context.function("after").call<double>(2);
+    Trace::disable();
+    assert(threw == 2);
+    assert(result == 2);
+    
+    std::stringstream trace;
+    Trace::dump(trace);
+    std::ostringstream decoded;
+    Trace::decode(trace, decoded);
+    
+    std::size_t enters = 0;
+    std::size_t exits = 0;
+    std::string after_line;
+    std::istringstream lines(decoded.str());
+    for (std::string line; std::getline(lines, line);) {
+      enters += line.find(" call ") != std::string::npos;
+      exits += line.find(" return ") != std::string::npos;
+      if (line.find("call after") != std::string::npos) {
+        after_line = line;
+      }
+    }
+    assert(enters == exits);
+    // Not indented below the calls that threw
+    assert(after_line.find("] call after") != std::string::npos);
+  }
+  
+  {
+    // Profiling the calls of fib: self cost per function, hardware counters
+    // where the kernel gives them
+    Context context;
+    context.load(R"(
+function fib(n) {
+  if (n < 2) {
+    return n;
+  }
+  return fib(n - 1) + fib(n - 2);
+}
+
+function main() {
+  return fib(15);
+}
+)", "profile.js");
+    
+    Profiler::clear();
+    Profiler::enable();
+    [[maybe_unused]] auto result = context.function("main").call<double>();
+    Profiler::disable();
+    assert(result == 610);
+    
+    auto report = Profiler::report();
+    [[maybe_unused]] auto fib = std::find_if(report.begin(), report.end(), [](const auto &function) { return function.name == "fib"; });
+    [[maybe_unused]] auto main_function = std::find_if(report.begin(), report.end(), [](const auto &function) { return function.name == "main"; });
+    assert(fib != report.end() && fib->calls == 1973);
+    assert(main_function != report.end() && main_function->calls == 1);
+    // Most of the time is spent in fib itself
+    assert(fib->counters[std::size_t(ProfileCounter::Time)] > main_function->counters[std::size_t(ProfileCounter::Time)]);
+    if (Profiler::counters_available()) {
+      assert(fib->counters[std::size_t(ProfileCounter::Instructions)] > 0);
+    }
+    
+    std::ostringstream table;
+    Profiler::dump(table);
+    assert(table.str().find("fib") != std::string::npos);
+  }
+#endif
+  
+  {
+    // Embedding: load once, call the same functions many times
+    Context context;
+    int host_calls = 0;
+    context.define("square", [](void *data, const NativeArguments &arguments) -> std::shared_ptr<JSValue> {
+      ++*static_cast<int *>(data);
+      auto x = arguments.number(0);
+      return Heap::make<JSNumber>(x * x);
+    }, &host_calls);
+    context.load(R"(
+let counter = 0;
+
+function count() {
+  counter = counter + 1;
+  return counter;
+}
+
+function sumOfSquares(a, b) {
+  return square(a) + square(b);
+}
+
+function pick(first, a, b) {
+  return first ? a : b;
+}
+
+function isLess(a, b) {
+  return a < b;
+}
+)", "embedding.js");
+    
+    auto count = context.function("count");
+    auto sum_of_squares = context.function("sumOfSquares");
+    auto missing = context.function("missing");
+    assert(count && sum_of_squares && !missing);
+    
+    double total = 0;
+    for (int i = 0; i != 1000; ++i) {
+      total += sum_of_squares.call<double>(i, 1.5);
+    }
+    assert(total == 332833500 + 1000 * 2.25);
+    assert(host_calls == 2000);
+    
+    [[maybe_unused]] auto first_count = count.call<double>();
+    [[maybe_unused]] auto second_count = count.call<double>();
+    auto picked = context.function("pick").call<std::string>(false, "hello", "world");
+    [[maybe_unused]] auto less = context.function("isLess").call<bool>(1, 2);
+    [[maybe_unused]] auto greater = context.function("isLess").call<bool>(2, 1);
+    assert(first_count == 1);
+    assert(second_count == 2);
+    assert(picked == "world");
+    assert(less);
+    assert(!greater);
+  }
+  
+  {
+    // Heap limits: a script that keeps growing gets an out of memory error,
+    // and the context stays usable
+    Context context;
+    context.load(R"(
+function cons(head, tail) {
+  function get() {
+    return head;
+  }
+  return get;
+}
+
+function grow(n) {
+  let list = 0;
+  for (let i = 0; i < n; i = i + 1) {
+    list = cons(i, list);
+  }
+  return list;
+}
+)", "heap.js");
+    
+    // Running once grows the frame stack and the feedback table, they are
+    // kept for the next calls
+    context.function("grow").call(1);
+    context.collect_garbage();
+    auto statistics = context.heap_statistics();
+    assert(statistics.used > 0);
+    assert(statistics.by_category[static_cast<std::size_t>(HeapCategory::Function)] > 0);
+    assert(statistics.by_category[static_cast<std::size_t>(HeapCategory::Frame)] > 0);
+    assert(statistics.by_category[static_cast<std::size_t>(HeapCategory::Feedback)] > 0);
+    
+    std::size_t near_limit_calls = 0;
+    context.set_near_heap_limit_callback([&](std::size_t used, std::size_t soft_limit) {
+      ++near_limit_calls;
+      return soft_limit;
+    });
+    context.set_heap_limits(statistics.used + 32 * 1024, statistics.used + 256 * 1024);
+    
+    [[maybe_unused]] bool out_of_memory = false;
+    try {
+      context.function("grow").call(100000);
+    } catch (const OutOfMemoryError &error) {
+      out_of_memory = true;
+    }
+    assert(out_of_memory);
+    assert(near_limit_calls == 1);
+    
+    [[maybe_unused]] auto after = context.heap_statistics();
+    assert(after.peak <= statistics.used + 256 * 1024);
+    assert(after.by_category[static_cast<std::size_t>(HeapCategory::Scope)] > 0);
+    
+    // The list left behind is garbage, it's collected when the heap is full
+    // again or on request
+    [[maybe_unused]] auto list = context.function("grow").call<bool>(10);
+    [[maybe_unused]] auto collected = context.collect_garbage();
+    [[maybe_unused]] auto used = context.heap_statistics().used;
+    assert(list);
+    assert(collected > 0);
+    assert(used == statistics.used);
+  }
+  
+  {
+    // Values can outlive their Context and be freed on other threads
+    std::vector<std::shared_ptr<JSValue>> values;
+    {
+      Context context;
+      context.load("function make(n) { function get() { return n; } return get; }", "values.js");
+      for (int i = 0; i != 4000; ++i) {
+        values.push_back(context.function("make").call(i));
+      }
+    }
+    std::vector<std::thread> threads;
+    for (std::size_t t = 0; t != 4; ++t) {
+      threads.emplace_back([&values, t] {
+        for (auto i = t; i < values.size(); i += 4) {
+          values[i].reset();
+        }
+      });
+    }
+    for (auto &thread : threads) {
+      thread.join();
+    }
+  }
+  
+  {
+    // Execution budget: running out of fuel, interrupts from another thread
+    // and deep recursion all unwind to the host
+    Context context;
+    context.load(R"(
+function fib(n) {
+  if (n < 3) {
+    return 1;
+  }
+  return fib(n - 1) + fib(n - 2);
+}
+
+function spin() {
+  let x = 0;
+  while (true) {
+    x = x + 1;
+  }
+  return x;
+}
+
+function down(n) {
+  return down(n + 1);
+}
+)", "budget.js");
+    
+    auto terminated = [&](const std::string &name, double argument) -> std::string {
+      try {
+        context.function(name).call(argument);
+      } catch (const std::runtime_error &error) {
+        return error.what();
+      }
+      return "";
+    };
+    
+    context.set_fuel_limit(10000);
+    auto error = terminated("fib", 30);
+    [[maybe_unused]] auto fib = context.function("fib").call<double>(10);
+    assert(error == "Error: execution terminated, out of fuel");
+    assert(fib == 55);
+    
+    context.set_fuel_limit(Execution::kUnlimited);
+    std::thread interrupter([&] {
+      std::this_thread::sleep_for(std::chrono::milliseconds(20));
+      context.interrupt();
+    });
+    error = terminated("spin", 0);
+    interrupter.join();
+    assert(error == "Error: execution terminated, interrupted");
+    
+    error = terminated("down", 0);
+    fib = context.function("fib").call<double>(20);
+    assert(error == "RangeError: Maximum call stack size exceeded");
+    assert(fib == 6765);
+  }
+  
+#if defined(__linux__) || defined(__APPLE__)
+  {
+    // Deep recursion on a thread with a small stack is a RangeError too, not
+    // a crash
+    struct Recursion {
+      std::string error;
+      double depth = 0;
+    } recursion;
+    pthread_attr_t attributes;
+    pthread_attr_init(&attributes);
+    pthread_attr_setstacksize(&attributes, 512 * 1024);
+    pthread_t thread;
+    pthread_create(&thread, &attributes, [](void *data) -> void * {
+      auto &recursion = *static_cast<Recursion *>(data);
+      Context context;
+      context.load(R"(
+let depth = 0;
+
+function down(n) {
+  depth = n;
+  let next = n + 1;
+  return 1 + down(next);
+}
+)", "stack.js");
+      try {
+        context.function("down").call(0);
+      } catch (const std::runtime_error &error) {
+        recursion.error = error.what();
+      }
+      recursion.depth = context.chain().lookup_value("depth")->as_number()->value;
+      return nullptr;
+    }, &recursion);
+    pthread_join(thread, nullptr);
+    pthread_attr_destroy(&attributes);
+    assert(recursion.error == "RangeError: Maximum call stack size exceeded");
+    assert(recursion.depth > 10);
+  }
+#endif
+  
+  {
+    // The loops of a hot function are compiled in the background while it
+    // keeps running in the interpreter
+    Context context;
+    context.load(R"(
+function sum(n) {
+  let total = 0;
+  for (let i = 0; i < n; i = i + 1) {
+    total = total + i;
+  }
+  return total;
+}
+)", "tier.js");
+    
+    auto sum = context.function("sum");
+    [[maybe_unused]] auto completed = CompileQueue::shared().completed();
+    for (int i = 0; i != kHotFunctionThreshold; ++i) {
+      [[maybe_unused]] auto total = sum.call<double>(100);
+      assert(total == 4950);
+    }
+    CompileQueue::shared().wait_idle();
+    assert(CompileQueue::shared().completed() == completed + 1);
+    
+    // Enters the compiled loop on its first back-edge
+    for (int i = 0; i != 100; ++i) {
+      [[maybe_unused]] auto total = sum.call<double>(i);
+      assert(total == i * (i - 1) / 2);
+    }
+    assert(CompileQueue::shared().completed() == completed + 1);
+  }
+  
+  {
+    // A compiled loop that runs out of fuel stores back what it wrote
+    Context context;
+    context.load(R"(
+let count = 0;
+let twice = 0;
+
+function countTo(n) {
+  for (let i = 0; i < n; i = i + 1) {
+    count = count + 1;
+    twice = twice + 2;
+  }
+  return count;
+}
+)", "terminated.js");
+    
+    auto count_to = context.function("countTo");
+    for (int i = 0; i != kHotFunctionThreshold; ++i) {
+      count_to.call(10);
+    }
+    CompileQueue::shared().wait_idle();
+    
+    context.set_fuel_limit(1000000);
+    [[maybe_unused]] bool threw = false;
+    try {
+      count_to.call(1e12);
+    } catch (const TerminationError &) {
+      threw = true;
+    }
+    assert(threw);
+    [[maybe_unused]] auto count = context.chain().lookup_value("count")->as_number()->value;
+    [[maybe_unused]] auto twice = context.chain().lookup_value("twice")->as_number()->value;
+    assert(count > 100 + 10000);
+    assert(twice == 2 * count);
+  }
+  
+  {
+    // Contexts on different threads share one parsed program, each with
+    // its own globals
+    const std::string source = R"(
+let calls = 0;
+
+function fib(n) {
+  calls = calls + 1;
+  if (n < 3) {
+    return 1;
+  }
+  return fib(n - 1) + fib(n - 2);
+}
+
+function sum(n) {
+  let total = 0;
+  for (let i = 0; i < n; i = i + 1) {
+    total = total + i;
+  }
+  return total;
+}
+
+function count() {
+  return calls;
+}
+)";
+    auto program = ProgramCache::shared().load(source, "shared.js");
+    auto same = ProgramCache::shared().load(source, "shared.js");
+    auto other = ProgramCache::shared().load(source, "other.js");
+    assert(same == program);
+    assert(other != program);
+    same.reset();
+    other.reset();
+    
+    std::atomic<int> failures {0};
+    std::vector<std::thread> threads;
+    for (int t = 0; t != 4; ++t) {
+      threads.emplace_back([&] {
+        Context context;
+        context.load(source, "shared.js");
+        for (int i = 0; i != 20; ++i) {
+          if (context.function("fib").call<double>(15) != 610 || context.function("sum").call<double>(2000) != 1999000) {
+            ++failures;
+          }
+        }
+        if (context.function("count").call<double>() != 20 * 1219) {
+          ++failures;
+        }
+      });
+    }
+    for (auto &thread : threads) {
+      thread.join();
+    }
+    assert(failures == 0);
+    assert(program.use_count() == 1);
+  }
+  
+  {
+    // Small leaf functions are inlined at call sites that keep calling the
+    // same code, and a different callee deoptimizes the call site
+    Context context;
+    context.load(R"(
+function getX(a, b) {
+  return a;
+}
+
+function getY(a, b) {
+  return b;
+}
+
+function adder(a) {
+  function add(b) {
+    return a + b;
+  }
+  return add;
+}
+
+function apply(f, a, b) {
+  return f(a, b);
+}
+
+function applyAdder(a, b) {
+  return adder(a)(b);
+}
+)", "inline.js");
+    
+    auto apply = context.function("apply");
+    auto get_x = context.chain().lookup_value("getX");
+    auto get_y = context.chain().lookup_value("getY");
+    
+    for (int i = 0; i != 3; ++i) {
+      [[maybe_unused]] auto x = apply.call<double>(get_x, 1, 2);
+      assert(x == 1);
+    }
+    // Closures of the same function share the inlined code
+    for (int i = 0; i != 3; ++i) {
+      [[maybe_unused]] auto sum = context.function("applyAdder").call<double>(i, 40);
+      assert(sum == 40 + i);
+    }
+    // Deoptimizes, then keeps making real calls
+    [[maybe_unused]] auto y = apply.call<double>(get_y, 1, 2);
+    [[maybe_unused]] auto x = apply.call<double>(get_x, 1, 2);
+    assert(y == 2);
+    assert(x == 1);
+  }
+  
+  {
+    // Globals are read and written through their cells, names declared by
+    // an enclosing function are not globals
+    auto source = R"(
+let total = 0;
+
+function bump(n) {
+  total = total + n;
+  return total;
+}
+
+function callBump(n) {
+  return bump(n);
+}
+
+function same(total) {
+  return total;
+}
+
+function outer(x) {
+  function inner() {
+    return x + total;
+  }
+  return inner();
+}
+
+function nested() {
+  let total = 100;
+  function inner() {
+    return total;
+  }
+  return inner();
+}
+
+function setLater() {
+  later = 5;
+  return later;
+}
+
+function readLater() {
+  return later;
+}
+
+function replace() {
+  bump = same;
+  return 0;
+}
+
+function callGreet() {
+  return greet();
+}
+)";
+    Context context;
+    context.define("greet", [](void *data, const NativeArguments &arguments) -> std::shared_ptr<JSValue> {
+      return Heap::make<JSNumber>(1);
+    });
+    context.load(source, "globals.js");
+    
+    [[maybe_unused]] auto bumped = context.function("callBump").call<double>(2);
+    assert(bumped == 2);
+    bumped = context.function("callBump").call<double>(3);
+    assert(bumped == 5);
+    [[maybe_unused]] auto outer = context.function("outer").call<double>(1);
+    assert(outer == 6);
+    [[maybe_unused]] auto nested = context.function("nested").call<double>();
+    assert(nested == 100);
+    [[maybe_unused]] auto same = context.function("same").call<double>(7);
+    assert(same == 7);
+    
+    auto unset = context.function("readLater").call<std::string>();
+    [[maybe_unused]] auto set = context.function("setLater").call<double>();
+    [[maybe_unused]] auto later = context.function("readLater").call<double>();
+    assert(unset == "undefined");
+    assert(set == 5);
+    assert(later == 5);
+    
+    // Callers see the new value of a reassigned global
+    context.function("replace").call();
+    bumped = context.function("callBump").call<double>(9);
+    outer = context.function("outer").call<double>(1);
+    assert(bumped == 9);
+    assert(outer == 6);
+    
+    // A built-in until the script declares a global of the same name
+    [[maybe_unused]] auto greeted = context.function("callGreet").call<double>();
+    assert(greeted == 1);
+    context.load("function greet() { return 2; }", "greet.js");
+    greeted = context.function("callGreet").call<double>();
+    assert(greeted == 2);
+    
+    // Every context has its own cells
+    Context other;
+    other.load(source, "globals.js");
+    bumped = other.function("callBump").call<double>(1);
+    outer = context.function("outer").call<double>(0);
+    assert(bumped == 1);
+    assert(outer == 5);
+  }
+  
+  {
+    // Generators: return values, closing, re-entrancy and where yield is
+    // allowed
+    Context context;
+    context.load(R"(
+let generator = 0;
+
+function* steps(a) {
+  yield a;
+  let b = yield a + 1;
+  if (b === undefined) {
+    return 0;
+  }
+  function add(c) {
+    return b + c;
+  }
+  yield add(1);
+  return b;
+}
+
+function* reentrant() {
+  yield generator.next();
+}
+
+function start(a) {
+  generator = steps(a);
+  return 0;
+}
+
+function step(value) {
+  return generator.next(value);
+}
+
+function startReentrant() {
+  generator = reentrant();
+  return 0;
+}
+
+function firstStep(a) {
+  return steps(a).next().value;
+}
+)", "steps.js");
+    
+    auto step = [&](std::shared_ptr<JSValue> value) {
+      auto result = context.function("step").call(value);
+      auto value_string = from_js_value<std::string>(result->get_property("value"));
+      return value_string + (is_truthy(result->get_property("done")) ? " done" : "");
+    };
+    auto undefined = Heap::make<JSUndefined>();
+    
+    context.function("start").call(1);
+    auto steps = std::vector<std::string> {
+      step(undefined),
+      step(undefined),
+      step(to_js_value(10)),
+      step(undefined),
+      step(undefined),
+    };
+    assert(steps == std::vector<std::string>({"1", "2", "11", "10 done", "undefined done"}));
+    
+    context.function("start").call(1);
+    step(undefined);
+    step(undefined);
+    auto last = step(undefined);
+    assert(last == "0 done");
+    
+    // next() keeps a generator nothing else refers to alive
+    [[maybe_unused]] auto first = context.function("firstStep").call<double>(7);
+    assert(first == 7);
+    
+    // Resuming a running generator throws and closes it
+    context.function("startReentrant").call();
+    [[maybe_unused]] bool threw = false;
+    try {
+      step(undefined);
+    } catch (const std::runtime_error &error) {
+      threw = std::string(error.what()) == "TypeError: Generator is already running";
+    }
+    last = step(undefined);
+    assert(threw);
+    assert(last == "undefined done");
+    
+    threw = false;
+    try {
+      context.load("function* nested() { return 1 + (yield 2); }", "nested.js");
+    } catch (const std::runtime_error &error) {
+      threw = std::string(error.what()).find("SyntaxError: yield is only supported") == 0;
+    }
+    assert(threw);
+  }
+  
+  {
+    // Hot reload replaces the changed functions and keeps the others warm
+    Context context;
+    context.load(R"(
+let calls = 0;
+
+function helper(x) {
+  return x + 1;
+}
+
+function compute(x) {
+  calls = calls + 1;
+  return helper(x) + helper(x);
+}
+
+function sum(n) {
+  let total = 0;
+  for (let i = 0; i < n; i = i + 1) {
+    total = total + compute(i);
+  }
+  return total;
+}
+)", "reload.js");
+    
+    auto declaration = [&](const std::string &name) {
+      return std::static_pointer_cast<JSFunction>(context.chain().lookup_value(name))->declaration;
+    };
+    
+    // Warm up, helper gets inlined into compute
+    [[maybe_unused]] auto total = context.function("sum").call<double>(20);
+    assert(total == 420);
+    auto sum = declaration("sum");
+    auto helper = declaration("helper");
+    
+    auto result = context.reload(R"(
+let calls = 1000;
+let version = 2;
+
+function helper(x) {
+  return x + 2;
+}
+
+function compute(x) {
+  calls = calls + 1;
+  return helper(x) + helper(x);
+}
+
+function sum(n) {
+  let total = 0;
+  for (let i = 0; i < n; i = i + 1) {
+    total = total + compute(i);
+  }
+  return total;
+}
+
+function twice(x) {
+  return compute(x) + compute(x);
+}
+)", "reload.js");
+    
+    assert(result.changed == std::vector<std::string>({"helper", "twice"}));
+    assert(result.unchanged == std::vector<std::string>({"compute", "sum"}));
+    auto new_sum = declaration("sum");
+    auto new_helper = declaration("helper");
+    assert(new_sum == sum && sum->is_compiled());
+    assert(new_helper != helper);
+    
+    // The inlined call sites of helper deoptimize
+    total = context.function("sum").call<double>(20);
+    [[maybe_unused]] auto twice = context.function("twice").call<double>(1);
+    assert(total == 460);
+    assert(twice == 12);
+    // Existing globals keep their values, new ones are defined
+    auto calls = context.chain().lookup_value("calls")->serialize();
+    auto version = context.chain().lookup_value("version")->serialize();
+    assert(calls == "42");
+    assert(version == "2");
+    
+    // A script that wasn't loaded before is loaded, all its functions are new
+    result = context.reload("function first() { return 1; }\nlet third = 3;\nfunction second() { return 2; }", "fresh.js");
+    assert(result.changed == std::vector<std::string>({"first", "second"}));
+    [[maybe_unused]] auto second = context.function("second").call<double>();
+    assert(result.unchanged.empty());
+    assert(second == 2);
+  }
+  
+  {
+    // Memoization of the functions proven pure
+    Context context;
+    context.define("host", [](void *data, const NativeArguments &arguments) -> std::shared_ptr<JSValue> {
+      return Heap::make<JSNumber>(arguments.number(0));
+    });
+    context.load(R"(
+let limit = 2;
+let counter = 0;
+
+function fib(n) {
+  if (n < limit) {
+    return n;
+  }
+  return fib(n - 1) + fib(n - 2);
+}
+
+function tri(n) {
+  let total = 0;
+  for (let i = 0; i < n; i = i + 1) {
+    total = total + i;
+  }
+  return n === 0 ? 0 : n + tri(n - 1);
+}
+
+function first(a, b) {
+  return a;
+}
+
+function impure(n) {
+  counter = n;
+  return n;
+}
+
+function readsMutable(n) {
+  return n + counter;
+}
+
+function callsHost(n) {
+  return host(n);
+}
+
+function makesClosure(n) {
+  function inner() {
+    return n;
+  }
+  return inner;
+}
+
+function callsImpure(n) {
+  return impure(n) + 1;
+}
+
+function viaParameter(f, n) {
+  return f(n);
+}
+
+function helper(n) {
+  return n + 1;
+}
+
+function viaHelper(n) {
+  return helper(n) + 3;
+}
+
+function unrelated(n) {
+  return n + n;
+}
+)", "memo.js");
+    
+    [[maybe_unused]] auto memoized = context.memoize("fib");
+    [[maybe_unused]] auto value = context.function("fib").call<double>(60);
+    auto statistics = *context.memo_statistics("fib");
+    assert(memoized);
+    assert(value == 1548008755920);
+    assert(statistics.misses == 61 && statistics.hits == 58 && statistics.evictions == 0);
+    value = context.function("fib").call<double>(60);
+    statistics = *context.memo_statistics("fib");
+    [[maybe_unused]] auto memo_bytes = context.heap_statistics().by_category[static_cast<std::size_t>(HeapCategory::Memo)];
+    assert(value == 1548008755920);
+    assert(statistics.hits == 59);
+    // The cached results are charged to the context
+    assert(memo_bytes > 61 * sizeof(std::shared_ptr<JSValue>));
+    
+    // Least recently used results are evicted
+    memoized = context.memoize("tri", 8);
+    value = context.function("tri").call<double>(20);
+    statistics = *context.memo_statistics("tri");
+    assert(memoized);
+    assert(value == 210);
+    assert(statistics.size == 8 && statistics.capacity == 8 && statistics.evictions == 13);
+    
+    // Only calls with primitive arguments are cached
+    memoized = context.memoize("first");
+    auto function = context.chain().lookup_value("first");
+    auto first_object = context.function("first").call(function, 1);
+    auto first_string = context.function("first").call<std::string>("a", 1);
+    statistics = *context.memo_statistics("first");
+    assert(memoized);
+    assert(first_object == function);
+    assert(first_string == "a");
+    assert(statistics.bypassed == 1 && statistics.misses == 1);
+    
+    for (auto name : {"impure", "readsMutable", "callsHost", "makesClosure", "callsImpure", "viaParameter", "missing"}) {
+      memoized = context.memoize(name);
+      [[maybe_unused]] auto rejected = context.memo_statistics(name);
+      assert(!memoized);
+      assert(!rejected);
+    }
+    
+    // Functions that can't assign what the memoized ones read aren't parsed
+    memoized = context.memoize("viaHelper");
+    value = context.function("viaHelper").call<double>(1);
+    auto unrelated = std::static_pointer_cast<JSFunction>(context.chain().lookup_value("unrelated"))->declaration;
+    assert(memoized);
+    assert(value == 5);
+    assert(!unrelated->is_compiled());
+    
+    // Scripts loaded later can make them impure
+    context.load(R"(
+function setLimit(n) {
+  limit = n;
+  return 0;
+}
+
+function helper(n) {
+  return n + 100;
+}
+)", "later.js");
+    [[maybe_unused]] auto fib_statistics = context.memo_statistics("fib");
+    [[maybe_unused]] auto via_helper_statistics = context.memo_statistics("viaHelper");
+    [[maybe_unused]] auto tri_statistics = context.memo_statistics("tri");
+    assert(!fib_statistics);
+    assert(!via_helper_statistics);
+    assert(tri_statistics && tri_statistics->size == 0);
+    context.function("setLimit").call(100);
+    value = context.function("fib").call<double>(10);
+    assert(value == 10);
+    value = context.function("viaHelper").call<double>(1);
+    assert(value == 104);
   }
   
   return 0;
@@ -13,14 +13,47 @@
 #include <memory>
 #include <vector>
 #include <map>
+#include <set>
+#include <functional>
+#include <optional>
+#include <algorithm>
+#include <chrono>
+#include <thread>
+#include <charconv>
+#include <sstream>
 #include <math.h>
 #include <cassert>
 #include <stdexcept>
+#include <cstring>
+#include <atomic>
+#include <mutex>
+#include <cstdint>
+#include <type_traits>
+#include <array>
+#include <condition_variable>
+#include <deque>
+#include <typeinfo>
+#include <iomanip>
+#include <list>
+#include <unordered_map>
+#include <string_view>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#if defined(__linux__) || defined(__APPLE__)
+#include <pthread.h>
+#endif
 
 enum class Token {
   Plus,
   Minus,
   EqualsEqualsEquals,
+  LessThan,
+  Equals,
 };
 
 enum class StatementKind {
@@ -28,6 +61,9 @@ enum class StatementKind {
   FunctionDeclaration,
   Return,
   If,
+  Expression,
+  While,
+  For,
 };
 
 class Node {
@@ -45,39 +81,139 @@ class JSBoolean;
 
 class Chain;
 
+// Cheap type check for the fast paths, see BinaryExpression
+enum class JSType {
+  Undefined,
+  Boolean,
+  Number,
+  String,
+  Object,
+  Function,
+};
+
 class JSValue {
 public:
+  const JSType type;
+  JSValue(JSType type) : type(type) {};
   virtual std::string serialize() const = 0;
   virtual std::shared_ptr<JSValue> plus_operator(std::shared_ptr<JSValue> right) const = 0;
   virtual std::shared_ptr<JSValue> minus_operator(std::shared_ptr<JSValue> right) const = 0;
   virtual std::shared_ptr<JSBoolean> equalsequalsequals_operator(std::shared_ptr<JSValue> right) const = 0;
+  virtual std::shared_ptr<JSBoolean> lessthan_operator(std::shared_ptr<JSValue> right) const = 0;
   virtual std::shared_ptr<JSNumber> as_number() const = 0;
   virtual std::shared_ptr<JSBoolean> as_boolean() const = 0;
   virtual std::shared_ptr<JSValue> call(Chain& chain, std::vector<std::shared_ptr<JSValue>> values) const = 0;
+  // Only objects have properties and only some functions are constructors,
+  // so unlike the operators these have defaults.
+  virtual std::shared_ptr<JSValue> get_property(const std::string name) const;
+  virtual std::shared_ptr<JSValue> construct(Chain& chain, std::vector<std::shared_ptr<JSValue>> values) const;
   virtual ~JSValue() {};
 };
 
 class Identifier;
 class SourceFile;
 
+// Memory of a Context is accounted by what it's used for, see Heap
+enum class HeapCategory {
+  Number,
+  String,
+  Boolean,
+  Object,
+  Function,
+  Scope,
+  // Variables of the calls whose scope isn't captured, see FrameStack
+  Frame,
+  // Per Context tables of what the code learned from running, see Feedback
+  Feedback,
+  // Results of memoized functions, see MemoCache
+  Memo,
+  Other,
+};
+
+const std::size_t kHeapCategories = 10;
+
+class Heap;
+Heap *current_heap();
+void *heap_allocate(Heap *heap, std::size_t bytes, HeapCategory category);
+void heap_deallocate(Heap *heap, void *pointer, std::size_t bytes, HeapCategory category);
+
+// Charges its allocations to a Heap, by default the one of the running
+// Context. Without a heap it's the global allocator.
+template <typename T>
+class HeapAllocator {
+public:
+  using value_type = T;
+  
+  Heap *heap;
+  HeapCategory category;
+  
+  HeapAllocator(HeapCategory category = HeapCategory::Other) : heap(current_heap()), category(category) {};
+  HeapAllocator(Heap *heap, HeapCategory category) : heap(heap), category(category) {};
+  
+  template <typename U>
+  HeapAllocator(const HeapAllocator<U> &other) : heap(other.heap), category(other.category) {};
+  
+  T *allocate(std::size_t count) {
+    return static_cast<T *>(heap_allocate(heap, count * sizeof(T), category));
+  }
+  
+  void deallocate(T *pointer, std::size_t count) {
+    heap_deallocate(heap, pointer, count * sizeof(T), category);
+  }
+  
+  template <typename U>
+  bool operator==(const HeapAllocator<U> &other) const { return heap == other.heap; }
+  template <typename U>
+  bool operator!=(const HeapAllocator<U> &other) const { return heap != other.heap; }
+};
+
+using Properties = std::map<std::string, std::shared_ptr<JSValue>, std::less<std::string>,
+  HeapAllocator<std::pair<const std::string, std::shared_ptr<JSValue>>>>;
+
+// Heap allocated scope, shared by the closures that capture it. A function
+// stored in the scope it captures forms a reference cycle, these are broken
+// when the Context is destroyed.
 class Scope {
 public:
-  std::map<std::string, std::shared_ptr<JSValue>> values {};
+  Properties values { Properties::allocator_type(HeapCategory::Scope) };
+  std::shared_ptr<Scope> parent {};
+  // Only filled in on the global scope: the entries of values that code
+  // resolved to globals reads, indexed by the id of the name (see
+  // GlobalNames). Map entries don't move, so they stay valid until the
+  // values are cleared.
+  std::vector<std::shared_ptr<JSValue> *> cells {};
+  // Entry of a global variable, null if it isn't defined (yet)
+  std::shared_ptr<JSValue> *cell(uint32_t id, const std::string &name);
   std::string serialize() const;
 };
 
+class Frame;
+class Feedback;
+class MemoCache;
+
 class Chain {
 public:
-  std::vector<Scope> scopes {};
+  // Innermost scope, the enclosing ones are linked through Scope::parent
+  std::shared_ptr<Scope> scope {};
+  // Variables of the running function when its scope is not captured by any
+  // closure (see FunctionDeclaration::is_scope_captured). Looked up first.
+  Frame *frame = nullptr;
+  // Built-in globals such as setTimeout, looked up after all scopes. They are
+  // shared rather than copied along with the scopes.
+  std::shared_ptr<const Scope> builtins {};
+  // Bottom of the scopes, where the cells of global variables are. Kept
+  // alive by the scopes above it.
+  Scope *global = nullptr;
+  // Type feedback of the running Context, owned by it. Without it nodes
+  // don't specialize.
+  Feedback *feedback = nullptr;
   std::shared_ptr<JSValue> lookup_value(const std::string name) const;
   void load(const SourceFile& sourceFile);
   void set_value(const std::string name, std::shared_ptr<JSValue> value);
-  Chain add(const Chain& chain) const;
+  void assign_value(const std::string name, std::shared_ptr<JSValue> value);
   
-  Chain() {};
-  Chain(const Chain &other) { scopes = other.scopes; }
-  
-  Chain add(const Scope& scope) const;
+  // What a closure keeps: everything but the frame, which dies with the call
+  Chain captured() const;
   
   std::string serialize() const;
 };
@@ -93,9 +229,36 @@ class Identifier: public Expression {
 public:
   const std::string text;
   Identifier(const std::string text): text(text) {};
+  // A copy starts with empty caches
+  Identifier(const Identifier &other): text(other.text) {};
   void visit() const override;
   std::shared_ptr<JSValue> evaluate(Chain& chain) const override;
+  void assign(Chain& chain, std::shared_ptr<JSValue> value) const;
   std::string serialize() const override;
+  
+  // Id of the name in trace events, interned on first use
+  uint32_t trace_name() const;
+  
+  // The name can only refer to a global variable, so it's read through the
+  // variable's cell instead of being looked up (see FunctionDeclaration::analyze)
+  void resolve_global() const;
+  
+private:
+  static constexpr uint32_t kNoTraceName = UINT32_MAX;
+  mutable std::atomic<uint32_t> trace_name_ {kNoTraceName};
+  
+  // Id from GlobalNames once the name is resolved to a global
+  static constexpr uint32_t kNotGlobal = UINT32_MAX;
+  mutable std::atomic<uint32_t> global_name_ {kNotGlobal};
+  
+  // Slot of the variable in the frame it was last found in. The names of a
+  // frame are owned by its function, so they identify the frame layout. The
+  // node may be shared between threads, but it belongs to one function, so
+  // they all find the same slot.
+  mutable std::atomic<const std::vector<std::string> *> frame_names_ {nullptr};
+  mutable std::atomic<int> frame_slot_ {-1};
+  
+  bool find_in_frame(Chain& chain) const;
 };
 
 class Statement;
@@ -104,6 +267,8 @@ class Block {
 public:
   std::vector<std::shared_ptr<Statement>> statements;
   Block(std::vector<std::shared_ptr<Statement>> statements): statements(statements) {};
+  std::shared_ptr<JSValue> evaluate(Chain& chain) const;
+  void tier_up() const;
   std::string serialize(const std::string offset) const;
 };
 
@@ -112,6 +277,8 @@ public:
   virtual std::shared_ptr<JSValue> evaluate(Chain& chain) const = 0;
   virtual StatementKind getKind() const = 0;
   virtual std::string serialize() const = 0;
+  // Starts compiling the loops in the statement, see CompileQueue
+  virtual void tier_up() const {};
   virtual ~Statement() {};
 };
 
@@ -121,23 +288,92 @@ public:
   Parameter(const Identifier name) : name(name){};
 };
 
-class FunctionDeclaration : public Statement {
+class GeneratorCode;
+
+// Body of a function. Functions coming from the parser are only preparsed:
+// the body keeps its source range and free variables, and the block is
+// parsed on the first call.
+class FunctionBody {
+public:
+  std::shared_ptr<const std::string> source;
+  std::size_t begin = 0;
+  std::size_t end = 0;
+  std::optional<std::vector<std::string>> free_variables;
+  std::optional<Block> block;
+  
+  // Filled in by the escape analysis once the block is built
+  bool scope_captured = false;
+  // Parameters first, then the names declared in the body
+  std::vector<std::string> locals;
+  // Names declared by the enclosing functions, given by their analysis
+  std::vector<std::string> outer_locals;
+  
+  // Bodies are shared by every context running the program (see
+  // ProgramCache). The parts computed lazily are written once under the
+  // mutex and published through the flags.
+  std::mutex mutex;
+  std::atomic<bool> parsed {false};
+  std::atomic<bool> has_free_variables {false};
+  std::atomic<bool> analyzed {false};
+  
+  // Hotness, the loops of a hot function are compiled ahead of time
+  std::atomic<int> calls {0};
+  
+  // Instructions of a generator function, built on its first call
+  std::shared_ptr<const GeneratorCode> generator_code;
+  std::atomic<bool> lowered {false};
+  
+  FunctionBody(const Block &block): block(block), parsed(true) {};
+  FunctionBody(std::shared_ptr<const std::string> source, std::size_t begin, std::size_t end,
+               std::vector<std::string> free_variables)
+  : source(source), begin(begin), end(end), free_variables(free_variables), has_free_variables(true) {};
+};
+
+class FunctionDeclaration : public Statement, public std::enable_shared_from_this<FunctionDeclaration> {
 public:
   const StatementKind kind;
   const Identifier name;
-  const Block body;
   const std::vector<Parameter> parameters;
+  // function*, calling it returns a JSGenerator
+  const bool is_generator;
   
   FunctionDeclaration(const Identifier name, const Block &body,
-                      const std::vector<Parameter> parameters)
-  : kind(StatementKind::FunctionDeclaration), name(name), body(body), parameters(parameters){};
+                      const std::vector<Parameter> parameters, bool is_generator = false)
+  : kind(StatementKind::FunctionDeclaration), name(name), parameters(parameters), is_generator(is_generator),
+  body_(std::make_shared<FunctionBody>(body)) {};
+  
+  FunctionDeclaration(const Identifier name, std::shared_ptr<FunctionBody> body,
+                      const std::vector<Parameter> parameters, bool is_generator = false)
+  : kind(StatementKind::FunctionDeclaration), name(name), parameters(parameters), is_generator(is_generator),
+  body_(body) {};
   
   std::shared_ptr<JSValue> evaluate(Chain &chain) const override;
   StatementKind getKind() const override;
   
+  // Parses the body first if the function was only preparsed
+  const Block &body() const;
+  bool is_compiled() const { return body_->parsed.load(std::memory_order_acquire); }
+  
+  // Escape analysis, see ScopeAnalysis
+  const std::vector<std::string> &free_variables() const;
+  const std::vector<std::string> &locals() const;
+  bool is_scope_captured() const;
+  
   std::shared_ptr<JSValue> execute(Chain &chain) const;
   
+  // The body of a generator function lowered to instructions
+  const GeneratorCode &generator_code() const;
+  
+  // Same parameters and body text, so one can stand in for the other
+  bool has_same_code(const FunctionDeclaration &other) const;
+  
   std::string serialize() const override;
+  
+private:
+  // Shared by all copies of the declaration, so it's parsed once
+  std::shared_ptr<FunctionBody> body_;
+  
+  void analyze() const;
 };
 
 #endif /* main_h */